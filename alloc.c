@@ -12,13 +12,43 @@
  * to exit.
  *
  * A similar story applies to send_error().
+ *
+ * The front-end makes lots of small, short-lived allocations (scopes,
+ * labels, symbols, growing vectors) that all die together at the end
+ * of a compilation or a program load. Those come from an Arena
+ * instead, a bump allocator that is released in one go.
+ *
+ * Node storage initialized from a file is mapped straight from the
+ * file by map_file().
+ *
+ * Every ecalloc() and erealloc() is counted against the current
+ * alloc_tag(), so that --time-phases can say how much each phase
+ * allocates. erealloc() counts the full new size, since that's what
+ * the call asks of malloc.
  */
+#define _POSIX_C_SOURCE 200809L
+
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "noded.h"
 
+/* Module-global variables */
+static struct {
+	size_t peak; /* the largest arena footprint */
+
+	Phase tag;
+	uint64_t allocs[NUM_PHASES];
+	uint64_t bytes[NUM_PHASES];
+} Globals = {0};
+
 static void
 check_sane_pointer(void *ptr)
 {
@@ -44,6 +74,8 @@ ecalloc(size_t nmemb, size_t size)
 	 */
 	if (!(nmemb || size)) return NULL;
 
+	Globals.allocs[Globals.tag]++;
+	Globals.bytes[Globals.tag] += nmemb * size;
 	result = calloc(nmemb, size);
 	check_sane_pointer(result);
 	return result;
@@ -60,7 +92,180 @@ erealloc(void *ptr, size_t size)
 		return NULL;
 	}
 
+	Globals.allocs[Globals.tag]++;
+	Globals.bytes[Globals.tag] += size;
 	result = realloc(ptr, size);
 	check_sane_pointer(result);
 	return result;
 }
+
+enum
+{
+	ARENA_CHUNK_SIZE = 4096,
+};
+
+struct ArenaChunk {
+	ArenaChunk *next;
+	size_t size;
+	size_t used;
+
+	/* The union keeps data aligned for any type. */
+	union {
+		long double ld;
+		void *ptr;
+		uint64_t u64;
+	} data[];
+};
+
+/* Round size up to the arena's alignment */
+static size_t
+align(size_t size)
+{
+	size_t unit = sizeof(((ArenaChunk *)NULL)->data[0]);
+	return (size + unit - 1) / unit * unit;
+}
+
+/* Return size zeroed bytes from the arena */
+void *
+arena_alloc(Arena *arena, size_t size)
+{
+	ArenaChunk *chunk = arena->chunks;
+	void *result;
+
+	if (!size) return NULL;
+	size = align(size);
+
+	if (!chunk || chunk->size - chunk->used < size) {
+		size_t chunksize = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+
+		chunk = ecalloc(1, sizeof(*chunk) + chunksize);
+		chunk->size = chunksize;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->size += sizeof(*chunk) + chunksize;
+		if (arena->size > Globals.peak)
+			Globals.peak = arena->size;
+	}
+
+	result = (char *)chunk->data + chunk->used;
+	chunk->used += size;
+	arena->used += size;
+	return result;
+}
+
+/* Resize an arena allocation of oldsize bytes. The most recent
+ * allocation grows in place when there's room; anything else is
+ * copied, and the old space is only reclaimed on release. */
+void *
+arena_realloc(Arena *arena, void *ptr, size_t oldsize, size_t size)
+{
+	ArenaChunk *chunk = arena->chunks;
+	void *result;
+
+	if (ptr && chunk) {
+		char *end = (char *)chunk->data + chunk->used;
+		size_t have = align(oldsize), want = align(size);
+
+		if ((char *)ptr + have == end && want >= have &&
+		    chunk->size - chunk->used >= want - have) {
+			memset(end, 0, want - have);
+			chunk->used += want - have;
+			arena->used += want - have;
+			return ptr;
+		}
+	}
+
+	result = arena_alloc(arena, size);
+	if (ptr) memcpy(result, ptr, oldsize < size ? oldsize : size);
+	return result;
+}
+
+/* Free everything allocated from the arena at once */
+void
+arena_release(Arena *arena)
+{
+	ArenaChunk *chunk = arena->chunks;
+
+	while (chunk) {
+		ArenaChunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+
+	memset(arena, 0, sizeof(*arena));
+}
+
+/* Return the largest footprint, in bytes, that any arena reached */
+size_t
+arena_peak(void)
+{
+	return Globals.peak;
+}
+
+/* Count allocations from now on against tag */
+void
+alloc_tag(Phase tag)
+{
+	Globals.tag = tag;
+}
+
+/* Return how many allocations have been counted against tag, and how
+ * many bytes they asked for */
+void
+alloc_counts(Phase tag, uint64_t *allocs, uint64_t *bytes)
+{
+	*allocs = Globals.allocs[tag];
+	*bytes = Globals.bytes[tag];
+}
+
+/*
+ * Return size bytes of writable storage holding the start of the file
+ * at path, or NULL (with errno set) if it can't be read. The file is
+ * mapped copy-on-write, so its pages are shared through the page cache
+ * until written to. If the file is shorter than size, mapping past its
+ * end would fault, so it's read into zeroed memory instead. *mapped
+ * says which, since mapped storage is freed with munmap(), not free().
+ */
+uint8_t *
+map_file(const char *path, size_t size, bool *mapped)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	uint8_t *data;
+	size_t len = 0;
+	ssize_t nread;
+	int saved;
+
+	if (fd < 0) return NULL;
+	if (fstat(fd, &st) < 0) goto fail;
+
+	if ((size_t) st.st_size >= size) {
+		data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+			fd, 0);
+		if (data != MAP_FAILED) {
+			close(fd);
+			*mapped = true;
+			return data;
+		}
+	}
+
+	*mapped = false;
+	data = ecalloc(size, 1);
+	while (len < size && (nread = read(fd, &data[len], size - len)) != 0) {
+		if (nread < 0) {
+			if (errno == EINTR) continue;
+			free(data);
+			goto fail;
+		}
+		len += (size_t) nread;
+	}
+
+	close(fd);
+	return data;
+
+fail:
+	saved = errno;
+	close(fd);
+	errno = saved;
+	return NULL;
+}
@@ -0,0 +1,116 @@
+#!/bin/sh
+#
+# bench.sh - run the benchmark workloads and report the results as JSON
+#
+#   sh bench/bench.sh [RUNS [OUTPUT]]
+#
+# Run from the top of the tree after `make noded noded-prof
+# bench/timeit`, which `make bench` does. Each workload is run RUNS
+# times (5 by default) with its input on stdin, and timed with
+# bench/timeit. Then it's run once more with no input, which stops it
+# as soon as it's loaded, to time startup. Instruction and message
+# counts are deterministic, so they're taken from a single run of the
+# profiling build, noded-prof. Bytes are those read from and
+# written to the IO node. The JSON goes to OUTPUT (bench/results.json
+# by default), and a summary to stdout.
+#
+# Inputs and generated programs are kept in bench/work, and only
+# generated again when missing, since they never change.
+
+set -e
+
+runs=${1:-5}
+out=${2:-bench/results.json}
+work=bench/work
+
+mkdir -p "$work"
+
+if [ ! -f "$work/input.txt" ]; then
+	echo "generating inputs..."
+	awk -v bytes=8388608 -v seed=1 -f bench/gen-input.awk >"$work/input.txt"
+fi
+[ -f "$work/chain.nod" ] ||
+	awk -v shape=chain -v n=2000 -f bench/gen-topology.awk >"$work/chain.nod"
+[ -f "$work/fan.nod" ] ||
+	awk -v shape=fan -v n=2048 -f bench/gen-topology.awk >"$work/fan.nod"
+
+# Print min, median and max of count divided by each of three times
+rates() {
+	echo "$1 $2" | awk '{
+		printf "{\"min\": %.0f, \"median\": %.0f, \"max\": %.0f}",
+			$1 / $4, $1 / $3, $1 / $2
+	}'
+}
+
+# Print three times as a JSON object
+span() {
+	echo "$1" | awk '{
+		printf "{\"min\": %s, \"median\": %s, \"max\": %s}", $1, $2, $3
+	}'
+}
+
+sep=""
+{
+	echo "{"
+	echo "  \"runs\": $runs,"
+	echo "  \"workloads\": ["
+} >"$out.tmp"
+
+# Run one workload: name, program, and how many bytes of input it gets
+workload() {
+	name=$1 prog=$2 bytes=$3
+	input="$work/$name.in"
+
+	head -c "$bytes" "$work/input.txt" >"$input"
+
+	./noded-prof --profile "$work/$name.prof" "$prog" \
+		<"$input" >"$work/$name.out" 2>/dev/null
+	instrs=$(awk '/"instructions"/ {
+		sub(/.*"instructions": /, ""); n += $0 + 0
+	} END { print n + 0 }' "$work/$name.prof")
+	msgs=$(awk '/"messages"/ {
+		sub(/.*"messages": /, ""); n += $0 + 0
+	} END { print n + 0 }' "$work/$name.prof")
+	sweeps=$(awk '/"sweeps"/ { sub(/.*"sweeps": /, ""); print $0 + 0 }' \
+		"$work/$name.prof")
+	outbytes=$(wc -c <"$work/$name.out" | tr -d ' ')
+	iobytes=$((bytes + outbytes))
+
+	secs=$(bench/timeit "$runs" "$input" ./noded "$prog")
+	startup=$(bench/timeit "$runs" /dev/null ./noded "$prog")
+
+	echo "$name: $(echo "$secs" | awk '{ print $2 }')s median," \
+		"$(echo "$startup" | awk '{ print $2 }')s startup"
+
+	cat >>"$out.tmp" <<-EOF
+	$sep    {
+	      "name": "$name",
+	      "program": "$prog",
+	      "input_bytes": $bytes,
+	      "output_bytes": $outbytes,
+	      "instructions": $instrs,
+	      "messages": $msgs,
+	      "sweeps": $sweeps,
+	      "seconds": $(span "$secs"),
+	      "instructions_per_sec": $(rates "$instrs" "$secs"),
+	      "messages_per_sec": $(rates "$msgs" "$secs"),
+	      "bytes_per_sec": $(rates "$iobytes" "$secs"),
+	      "startup_seconds": $(span "$startup")
+	    }
+	EOF
+	sep=","
+}
+
+workload compute bench/compute.nod 16384
+workload handshake bench/handshake.nod 1048576
+workload buffer bench/buffer.nod 1048576
+workload io bench/io.nod 8388608
+workload chain "$work/chain.nod" 4096
+workload fan "$work/fan.nod" 4096
+
+{
+	echo "  ]"
+	echo "}"
+} >>"$out.tmp"
+mv "$out.tmp" "$out"
+echo "results written to $out"
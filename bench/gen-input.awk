@@ -0,0 +1,30 @@
+# gen-input.awk - print deterministic pseudo-random text
+#
+#   awk -v bytes=N [-v seed=S] -f gen-input.awk
+#
+# Prints exactly N bytes of lines of letters, digits and punctuation,
+# 20 to 79 bytes long. The generator is a 32-bit LCG kept within the
+# exact range of a double, so every awk prints the same text for the
+# same seed.
+
+function next_rand() {
+	state = (state * 69069 + 1) % 4294967296
+	return int(state / 65536)
+}
+
+BEGIN {
+	chars = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJKLMNOPQRSTUVWXYZ 0123456789 .,;:!?"
+	nchars = length(chars)
+	state = seed ? seed : 1
+
+	for (n = 0; n < bytes; n += len + 1) {
+		len = 20 + next_rand() % 60
+		if (len > bytes - n - 1)
+			len = bytes - n - 1
+
+		line = ""
+		for (i = 0; i < len; i++)
+			line = line substr(chars, next_rand() % nchars + 1, 1)
+		print line
+	}
+}
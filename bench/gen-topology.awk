@@ -0,0 +1,55 @@
+# gen-topology.awk - print a large generated noded program
+#
+#   awk -v shape=chain -v n=N -f gen-topology.awk
+#   awk -v shape=fan -v n=N -f gen-topology.awk
+#
+# A chain relays input through N processors in series. A fan sends
+# each input byte through a broadcast node to 16 chains of N/16
+# processors each, and merges their output back together. Every
+# processor adds its own constant to the bytes it relays, so that no
+# two bodies compile to the same code, and loading the program costs
+# as much as it would for as many hand-written processors.
+
+function relay(name) {
+	printf "processor %s {\n\t$c <- %%in;\n\t%%out <- $c + %d;\n}\n\n",
+		name, nprocs++ % 251 + 1
+}
+
+# Print a chain of len processors named prefix0, prefix1, etc.
+function chain(prefix, len,    i) {
+	for (i = 0; i < len; i++)
+		relay(prefix i)
+	for (i = 1; i < len; i++)
+		printf "%s%d.out -> %s%d.in;\n", prefix, i-1, prefix, i
+	print ""
+}
+
+BEGIN {
+	if (n < 1) n = 1000
+
+	printf "/* %s of %d processors, generated by gen-topology.awk */\n\n", shape, n
+
+	if (shape == "fan") {
+		len = int(n / 16)
+		if (len < 1) len = 1
+
+		print "broadcast fan[16];"
+		print "merge join[16];"
+		print ""
+		print "processor src {\n\t%fan <- %in;\n}\n"
+		print "processor sink {\n\t%out <- %join;\n}\n"
+		for (c = 0; c < 16; c++) {
+			chain("c" c "_", len)
+			printf "c%d_0.in -> fan.out%d;\n", c, c
+			printf "c%d_%d.out -> join.in%d;\n\n", c, len-1, c
+		}
+		print "io.in -> src.in;"
+		print "src.fan -> fan.in;"
+		print "sink.join -> join.out;"
+		print "sink.out -> io.out;"
+	} else {
+		chain("p", n)
+		print "io.in -> p0.in;"
+		printf "p%d.out -> io.out;\n", n-1
+	}
+}
@@ -0,0 +1,295 @@
+/*
+ * micro - microbenchmarks of the VM's primitives
+ *
+ *   micro [RUNS [CASE...]]
+ *
+ * Each case builds a small VM in code and times run() on it alone, so
+ * that loading doesn't count, or times a loop of calls to one
+ * function. Cases run twice to warm up, then RUNS times (15 by
+ * default), and each prints the minimum, median, mean, standard
+ * deviation and maximum of its runs in nanoseconds per op. Only the
+ * cases whose names start with one of the CASEs run, if any are given.
+ *
+ * The VMs have up to four nodes: processor A, processor B, a buffer
+ * and a stack. A's ports are wired by name: %out to B's %in, %idx and
+ * %elm to the buffer's, and %st to the stack. Their processors run
+ * until they've executed TICKS instructions between them.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <err.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../noded.h"
+
+enum
+{
+	WARMUP = 2,
+	DEFAULT_RUNS = 15,
+	TICKS = 1<<22, /* instructions per VM run */
+	COMPARES = 1<<24, /* about how many strcmp()s sym_id() runs make */
+};
+
+enum
+{
+	NODE_A,
+	NODE_B,
+	NODE_BUF,
+	NODE_STACK,
+	NUM_NODES,
+};
+
+typedef struct Case Case;
+struct Case {
+	const char *name;
+	const char *op; /* what one op is */
+	double (*run)(const Case *c, uint64_t *ops); /* returns ns taken */
+
+	const char *a, *b; /* processor bodies, for VM cases */
+	bool per_message; /* count messages as ops, rather than ticks */
+	int sends; /* messages sent per op */
+	size_t nsyms; /* dictionary size, for sym_id() cases */
+};
+
+static double run_vm(const Case *c, uint64_t *ops);
+static double run_sym_id(const Case *c, uint64_t *ops);
+
+static const Case cases[] = {
+	/* tick() dispatch, by opcode class */
+	{.name = "tick/locals", .op = "instr", .run = run_vm,
+		.a = "{ $a = $b; $b = $c; $c = $d; $d = $a; }"},
+	{.name = "tick/arith", .op = "instr", .run = run_vm,
+		.a = "{ $a = ($a + 3) * 5 - $b / 7 % 3 ^ $a >> 1; $b++; }"},
+	{.name = "tick/logic", .op = "instr", .run = run_vm,
+		.a = "{ $a = $a < 9 || $b == 3 && !$c; $c = $a <= $b; $b--; }"},
+	{.name = "tick/branch", .op = "instr", .run = run_vm,
+		.a = "{ if ($a) $b = 1; else $b = 2; $a = !$a; }"},
+	{.name = "tick/array", .op = "instr", .run = run_vm,
+		.a = "{ $t[16]; $t[$i] = $t[$i + 1] + 1; $i++; }"},
+
+	/* send_proc()/recv_proc() */
+	{.name = "wire/handshake", .op = "message", .run = run_vm,
+		.a = "{ %out <- $i; $i++; }", .b = "{ $x <- %in; }",
+		.per_message = true, .sends = 1},
+
+	/* send_buf()/recv_buf() */
+	{.name = "buffer/read", .op = "read", .run = run_vm,
+		.a = "{ %idx <- $i; $x <- %elm; $i++; }",
+		.per_message = true, .sends = 1},
+	{.name = "buffer/write", .op = "write", .run = run_vm,
+		.a = "{ %idx <- $i; %elm <- $i; $i++; }",
+		.per_message = true, .sends = 2},
+
+	/* send_stack()/recv_stack(), as the stack grows and drains */
+	{.name = "stack/push", .op = "push", .run = run_vm,
+		.a = "{ %st <- $i; $i++; }",
+		.per_message = true, .sends = 1},
+	{.name = "stack/push-pop", .op = "push+pop", .run = run_vm,
+		.a = "{ $n = 0; while ($n < 200) { %st <- $n; $n++; }"
+			" while ($n) { $x <- %st; $n--; } }",
+		.per_message = true, .sends = 1},
+
+	/* sym_id() hits, in dictionaries of a few sizes */
+	{.name = "sym_id/16", .op = "lookup", .run = run_sym_id, .nsyms = 16},
+	{.name = "sym_id/256", .op = "lookup", .run = run_sym_id, .nsyms = 256},
+	{.name = "sym_id/4096", .op = "lookup", .run = run_sym_id, .nsyms = 4096},
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void
+compile_body(const char *src, SymDict *dict, CodeBlock *block)
+{
+	FILE *f = fmemopen((void *) src, strlen(src), "r");
+	Scanner s;
+
+	if (!f) err(1, "fmemopen");
+	init_error(f, "micro");
+	init_scanner(&s, f);
+	compile(&s, dict, block);
+	if (has_errors()) errx(1, "can't compile %s", src);
+	fclose(f);
+}
+
+/* Wire port p of processor A, by its name */
+static void
+wire_port(VM *vm, const SymDict *dict, const CodeBlock *a, const CodeBlock *b,
+	int p)
+{
+	const char *name = id_sym(dict, a->ports[p]);
+
+	if (strcmp(name, "out") == 0) {
+		for (int q = 0; q < b->nports; q++) {
+			if (strcmp(id_sym(dict, b->ports[q]), "in") == 0) {
+				add_wire(vm, NODE_A, p, NODE_B, q);
+				return;
+			}
+		}
+		errx(1, "B has no %%in for A's %%out");
+	} else if (strcmp(name, "idx") == 0) {
+		add_wire(vm, NODE_A, p, NODE_BUF, BUFFER_IDX);
+	} else if (strcmp(name, "elm") == 0) {
+		add_wire(vm, NODE_A, p, NODE_BUF, BUFFER_ELM);
+	} else if (strcmp(name, "st") == 0) {
+		add_wire(vm, NODE_A, p, NODE_STACK, STACK_ELM);
+	} else {
+		errx(1, "don't know where to wire %%%s", name);
+	}
+}
+
+/* Build the case's VM and time one run of it */
+static double
+run_vm(const Case *c, uint64_t *ops)
+{
+	Arena arena = {0};
+	SymDict dict = {.arena = &arena};
+	CodeBlock a = {0}, b = {0};
+	VMStats st;
+	uint64_t start, end;
+	VM vm;
+
+	compile_body(c->a, &dict, &a);
+	compile_body(c->b ? c->b : "{ halt; }", &dict, &b);
+
+	vm_init(&vm, NUM_NODES, (size_t) a.nports);
+	set_instr_budget(&vm, TICKS);
+	add_proc_node(&vm, &a);
+	add_proc_node(&vm, &b);
+	add_buf_node(&vm, ecalloc(BUFFER_NODE_MAX, 1), false);
+	add_stack_node(&vm);
+	for (int p = 0; p < a.nports; p++)
+		wire_port(&vm, &dict, &a, &b, p);
+	link_vm(&vm);
+
+	start = now_ns();
+	run(&vm);
+	end = now_ns();
+
+	vm_stats(&st);
+	*ops = c->per_message ? st.messages / (uint64_t) c->sends : vm.ticks;
+	if (*ops == 0) errx(1, "%s: nothing ran", c->name);
+
+	vm_free(&vm);
+	free(a.code);
+	free(a.lines);
+	free(b.code);
+	free(b.lines);
+	clear_dict(&dict);
+	arena_release(&arena);
+	return (double) (end - start);
+}
+
+/* Time sym_id() finding each of a dictionary's symbols in turn. Its
+ * cost grows with the dictionary, so bigger ones get fewer lookups. */
+static double
+run_sym_id(const Case *c, uint64_t *ops)
+{
+	SymDict dict = {0};
+	char **syms = ecalloc(c->nsyms, sizeof(*syms));
+	size_t lookups = COMPARES / c->nsyms;
+	volatile size_t sink = 0;
+	uint64_t start, end;
+
+	for (size_t i = 0; i < c->nsyms; i++) {
+		syms[i] = ecalloc(24, 1);
+		snprintf(syms[i], 24, "sym%zu", i);
+		sym_id(&dict, syms[i]);
+	}
+
+	start = now_ns();
+	for (size_t i = 0; i < lookups; i++)
+		sink += sym_id(&dict, syms[i % c->nsyms]);
+	end = now_ns();
+	(void)sink;
+
+	for (size_t i = 0; i < c->nsyms; i++)
+		free(syms[i]);
+	free(syms);
+	clear_dict(&dict);
+
+	*ops = lookups;
+	return (double) (end - start);
+}
+
+static int
+compare_doubles(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+bench(const Case *c, int runs)
+{
+	double *nsop = ecalloc((size_t) runs, sizeof(*nsop));
+	double mean = 0, var = 0, median;
+	uint64_t ops;
+
+	for (int i = 0; i < WARMUP; i++)
+		c->run(c, &ops);
+	for (int i = 0; i < runs; i++) {
+		nsop[i] = c->run(c, &ops) / (double) ops;
+		mean += nsop[i];
+	}
+	mean /= runs;
+	for (int i = 0; i < runs; i++)
+		var += (nsop[i] - mean) * (nsop[i] - mean);
+	var = runs > 1 ? var / (runs - 1) : 0;
+
+	qsort(nsop, (size_t) runs, sizeof(*nsop), &compare_doubles);
+	median = runs % 2 ? nsop[runs / 2]
+		: (nsop[runs / 2 - 1] + nsop[runs / 2]) / 2;
+
+	printf("%-16s %-9s %9.2f %9.2f %9.2f %9.2f %9.2f\n", c->name, c->op,
+		nsop[0], median, mean, sqrt(var), nsop[runs - 1]);
+	free(nsop);
+}
+
+/* Whether c was asked for on the command line */
+static bool
+selected(const Case *c, int argc, char *argv[])
+{
+	if (argc < 3) return true;
+	for (int i = 2; i < argc; i++) {
+		if (strncmp(c->name, argv[i], strlen(argv[i])) == 0)
+			return true;
+	}
+	return false;
+}
+
+int
+main(int argc, char *argv[])
+{
+	int runs = DEFAULT_RUNS;
+
+	if (argc > 1) {
+		char *endptr;
+
+		runs = (int) strtol(argv[1], &endptr, 10);
+		if (endptr == argv[1] || *endptr != '\0' || runs < 1) {
+			fprintf(stderr, "usage: %s [RUNS [CASE...]]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	printf("%-16s %-9s %9s %9s %9s %9s %9s\n", "case", "op",
+		"min", "median", "mean", "stddev", "max");
+	for (size_t i = 0; i < sizeof(cases)/sizeof(*cases); i++) {
+		if (selected(&cases[i], argc, argv))
+			bench(&cases[i], runs);
+	}
+	printf("(ns per op)\n");
+	return 0;
+}
@@ -0,0 +1,92 @@
+/*
+ * timeit - time repeated runs of a command
+ *
+ *   timeit RUNS INPUT COMMAND [ARG...]
+ *
+ * Runs COMMAND RUNS times, with its standard input read from INPUT and
+ * its standard output thrown away, and prints the minimum, median and
+ * maximum wall time of the runs in seconds. Fails if any run does.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Run argv once, and return how long it took in nanoseconds */
+static uint64_t
+time_run(const char *input, char *argv[])
+{
+	uint64_t start = now_ns();
+	int status;
+	pid_t pid;
+
+	if ((pid = fork()) < 0)
+		err(1, "fork");
+
+	if (pid == 0) {
+		int in = open(input, O_RDONLY);
+		int out = open("/dev/null", O_WRONLY);
+
+		if (in < 0) err(1, "%s", input);
+		if (out < 0) err(1, "/dev/null");
+		dup2(in, STDIN_FILENO);
+		dup2(out, STDOUT_FILENO);
+		execvp(argv[0], argv);
+		err(127, "%s", argv[0]);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		err(1, "waitpid");
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		errx(1, "%s failed", argv[0]);
+
+	return now_ns() - start;
+}
+
+static int
+compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint64_t *times, median;
+	long runs;
+
+	if (argc < 4 || (runs = strtol(argv[1], NULL, 10)) < 1) {
+		fprintf(stderr, "usage: %s RUNS INPUT COMMAND [ARG...]\n", argv[0]);
+		return 1;
+	}
+
+	if (!(times = calloc((size_t) runs, sizeof(*times))))
+		err(1, "calloc");
+	for (long i = 0; i < runs; i++)
+		times[i] = time_run(argv[2], &argv[3]);
+
+	qsort(times, (size_t) runs, sizeof(*times), &compare);
+	median = runs % 2 ? times[runs/2] : (times[runs/2-1] + times[runs/2]) / 2;
+	printf("%.9f %.9f %.9f\n", times[0] / 1e9, median / 1e9,
+		times[runs-1] / 1e9);
+
+	free(times);
+	return 0;
+}
@@ -0,0 +1,297 @@
+/*
+ * cache - on-disk cache of compiled processor bodies
+ *
+ * Programs generated from templates repeat the same processor bodies
+ * across many files, so compiled bodies are stored in a cache
+ * directory, keyed by a hash of the body's token stream. Tokens are
+ * hashed instead of raw text, so that whitespace and comments don't
+ * get in the way of a cache hit. Each token's line relative to the
+ * start of the body is hashed too, since the line table depends on it.
+ *
+ * A cache entry stores the bytecode alongside the *names* of its ports
+ * and variables, since symbol IDs are only meaningful to the SymDict
+ * of a single run. Each file is laid out as:
+ *
+ *   "NODC" version:u8 key:u64 size:u16 nports:u8 nvars:u16 arrsize:u16
+ *   { namelen:u16 name } (nports + nvars times)
+ *   code (size bytes)
+ *   linesize:u32 lines (linesize bytes)
+ *
+ * All integers are little-endian. BYTECODE_VERSION is mixed into the
+ * key and checked against the header, so bumping it invalidates every
+ * existing entry.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "noded.h"
+
+static const char MAGIC[4] = "NODC";
+
+/* Module-global variables */
+static struct {
+	const char *dir;
+} Globals = {0};
+
+void
+init_cache(const char *dir)
+{
+	Globals.dir = dir;
+
+	if (mkdir(dir, 0777) < 0 && errno != EEXIST)
+		fprintf(stderr, "warning: cannot create cache directory %s.\n", dir);
+}
+
+/* Fold dat into hash with 64-bit FNV-1a. Start with HASH_INIT. */
+uint64_t
+hash_bytes(uint64_t hash, const void *dat, size_t len)
+{
+	const uint8_t *bytes = dat;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= bytes[i];
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
+
+/* Consume a processor body and return a hash of its tokens. */
+static uint64_t
+hash_body(Scanner *s)
+{
+	uint64_t hash = HASH_INIT;
+	uint8_t version = BYTECODE_VERSION;
+	Token tok;
+	int depth = 0;
+	int line0, line;
+
+	peek(s, &tok);
+	line0 = tok.pos.lineno;
+	hash = hash_bytes(hash, &version, sizeof(version));
+	do {
+		scan(s, &tok);
+		line = tok.pos.lineno - line0;
+		switch (tok.type) {
+		case LBRACE: depth++; break;
+		case RBRACE: depth--; break;
+		case TOK_EOF:
+			send_error(&tok.pos, ERR, "EOF reached within node block");
+			return hash;
+		default: break;
+		}
+
+		/* Include the terminating '\0' so that adjacent
+		 * literals can't run together. */
+		hash = hash_bytes(hash, &tok.type, sizeof(tok.type));
+		hash = hash_bytes(hash, &line, sizeof(line));
+		hash = hash_bytes(hash, tok.lit, strlen(tok.lit)+1);
+	} while (depth > 0);
+
+	return hash;
+}
+
+static char *
+entry_path(uint64_t key)
+{
+	size_t len = strlen(Globals.dir) + sizeof("/0123456789abcdef.nbc");
+	char *path = ecalloc(len, 1);
+
+	snprintf(path, len, "%s/%016llx.nbc", Globals.dir,
+		(unsigned long long) key);
+	return path;
+}
+
+static bool
+read_int(FILE *f, uint64_t *dest, int nbytes)
+{
+	int c;
+
+	*dest = 0;
+	for (int i = 0; i < nbytes; i++) {
+		if ((c = getc(f)) == EOF) return false;
+		*dest |= (uint64_t) c << (8*i);
+	}
+
+	return true;
+}
+
+static void
+write_int(FILE *f, uint64_t val, int nbytes)
+{
+	for (int i = 0; i < nbytes; i++)
+		putc((val >> (8*i)) & 0xFF, f);
+}
+
+/* Read a length-prefixed name and intern it into the dictionary */
+static bool
+read_name(FILE *f, SymDict *dict, size_t *id)
+{
+	char name[LITERAL_MAX+1];
+	uint64_t len;
+
+	if (!read_int(f, &len, 2) || len > LITERAL_MAX) return false;
+	if (fread(name, 1, len, f) != len) return false;
+	name[len] = '\0';
+
+	*id = sym_id(dict, name);
+	return true;
+}
+
+static void
+write_name(FILE *f, const SymDict *dict, size_t id)
+{
+	const char *name = id_sym(dict, id);
+	size_t len = strlen(name);
+
+	write_int(f, len, 2);
+	fwrite(name, 1, len, f);
+}
+
+/* Fill *block from the cache entry for key. Return whether the entry
+ * exists and is valid, including its code, which may be stale or
+ * damaged in ways the header doesn't show. */
+static bool
+load_block(uint64_t key, SymDict *dict, CodeBlock *block)
+{
+	char *path = entry_path(key);
+	FILE *f = fopen(path, "rb");
+	char magic[sizeof(MAGIC)];
+	uint64_t version, stored_key, size, nports, nvars, arrsize, linesize;
+	bool ok = false;
+
+	free(path);
+	if (!f) return false;
+
+	memset(block, 0, sizeof(*block));
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) ||
+	    memcmp(magic, MAGIC, sizeof(MAGIC)) != 0)
+		goto exit;
+
+	if (!read_int(f, &version, 1) || version != BYTECODE_VERSION ||
+	    !read_int(f, &stored_key, 8) || stored_key != key ||
+	    !read_int(f, &size, 2) ||
+	    !read_int(f, &nports, 1) || nports > PORT_MAX ||
+	    !read_int(f, &nvars, 2) || nvars > VAR_MAX ||
+	    !read_int(f, &arrsize, 2) || arrsize > ARRAY_BYTES)
+		goto exit;
+
+	block->nports = (int) nports;
+	for (int i = 0; i < block->nports; i++) {
+		if (!read_name(f, dict, &block->ports[i])) goto exit;
+	}
+
+	block->nvars = (int) nvars;
+	for (int i = 0; i < block->nvars; i++) {
+		if (!read_name(f, dict, &block->vars[i])) goto exit;
+	}
+
+	block->arrsize = (uint16_t) arrsize;
+	block->size = (uint16_t) size;
+	block->code = ecalloc(size, 1);
+	if (fread(block->code, 1, size, f) != size) {
+		free(block->code);
+		goto exit;
+	}
+
+	if (!read_int(f, &linesize, 4) || linesize > (uint64_t) size*8) {
+		free(block->code);
+		goto exit;
+	}
+	block->linesize = (uint32_t) linesize;
+	block->lines = ecalloc(linesize + 1, 1);
+	if (fread(block->lines, 1, linesize, f) != linesize ||
+	    !check_code(block)) {
+		free(block->lines);
+		free(block->code);
+		goto exit;
+	}
+
+	ok = true;
+
+exit:
+	fclose(f);
+	if (!ok) memset(block, 0, sizeof(*block));
+	return ok;
+}
+
+/* Write *block to the cache under key. The entry is written to a
+ * temporary file and renamed into place, so concurrent runs sharing a
+ * cache never see a partial entry. Failures only cost a cache miss
+ * later, so they are silently ignored. */
+static void
+store_block(uint64_t key, const SymDict *dict, const CodeBlock *block)
+{
+	char *path = entry_path(key);
+	size_t tmplen = strlen(path) + sizeof(".tmp.4294967295");
+	char *tmppath = ecalloc(tmplen, 1);
+	FILE *f;
+
+	snprintf(tmppath, tmplen, "%s.tmp.%lu", path, (unsigned long) getpid());
+	f = fopen(tmppath, "wb");
+	if (!f) goto exit;
+
+	fwrite(MAGIC, 1, sizeof(MAGIC), f);
+	write_int(f, BYTECODE_VERSION, 1);
+	write_int(f, key, 8);
+	write_int(f, block->size, 2);
+	write_int(f, block->nports, 1);
+	write_int(f, block->nvars, 2);
+	write_int(f, block->arrsize, 2);
+
+	for (int i = 0; i < block->nports; i++)
+		write_name(f, dict, block->ports[i]);
+	for (int i = 0; i < block->nvars; i++)
+		write_name(f, dict, block->vars[i]);
+	fwrite(block->code, 1, block->size, f);
+	write_int(f, block->linesize, 4);
+	fwrite(block->lines, 1, block->linesize, f);
+
+	if (fclose(f) != 0 || rename(tmppath, path) < 0)
+		remove(tmppath);
+
+exit:
+	free(tmppath);
+	free(path);
+}
+
+/* Compile a processor body like compile(), reusing a cached result
+ * when the same body has been compiled before. */
+void
+compile_cached(Scanner *s, SymDict *dict, CodeBlock *block)
+{
+	ScanMark *mark;
+	uint64_t key;
+	Token tok;
+
+	if (!Globals.dir) {
+		compile(s, dict, block);
+		return;
+	}
+
+	mark = mark_scanner(s);
+	peek(s, &tok);
+	key = hash_body(s);
+	if (has_errors()) {
+		memset(block, 0, sizeof(*block));
+		free(mark);
+		return;
+	}
+
+	if (load_block(key, dict, block)) {
+		block->line = tok.pos.lineno;
+		free(mark);
+		return;
+	}
+
+	/* Cache miss: rewind back over the body and compile it */
+	reset_scanner(s, mark);
+	free(mark);
+	compile(s, dict, block);
+	if (!has_errors())
+		store_block(key, dict, block);
+}
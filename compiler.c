@@ -27,17 +27,42 @@ struct Scope {
 	uint16_t continue_addr;
 };
 
+/* A private array, stored at base within the processor's array bytes */
+typedef struct Array Array;
+struct Array {
+	size_t id;
+	uint16_t base;
+	uint16_t size;
+};
+
 typedef struct Context Context;
 struct Context {
 	Scanner *s;
 	SymDict *dict;
 
+	/* Everything the compiler allocates lives here until compile()
+	 * returns. */
+	Arena arena;
+
 	Scope *scope;
 
 	size_t ports[PORT_MAX];
 	int nports;
 	size_t vars[VAR_MAX];
 	int nvars;
+	Array arrays[ARRAY_MAX];
+	int narrays;
+	uint16_t arrsize;
+
+	/* The line table so far. Each statement's line is held back in
+	 * pend_* until code is assembled for it, so that statements
+	 * without code don't take up entries. */
+	ByteVec lines;
+	int line0;
+	uint16_t line_addr;
+	int line;
+	uint16_t pend_addr;
+	int pend_line;
 
 	/* inline label struct vector */
 	Label *labels;
@@ -69,9 +94,15 @@ typedef enum
 } Precedence;
 
 typedef struct Expression Expression;
+/* An EXPR_ELEM has its array index already assembled, waiting for an
+ * OP_ALOAD or OP_ASTORE. Array stores and declarations leave nothing
+ * behind, so like send statements they can't be operands. */
 struct Expression {
-	enum { EXPR_NORMAL, EXPR_PORT, EXPR_VAR, EXPR_SEND } type;
-	int idx; /* Port index or variable index */
+	enum {
+		EXPR_NORMAL, EXPR_PORT, EXPR_VAR, EXPR_SEND,
+		EXPR_ELEM, EXPR_STORE, EXPR_DECL
+	} type;
+	int idx; /* Port, variable, or array index */
 };
 
 typedef Expression (*PrefixParselet)(Context *ctx, Token *tok);
@@ -200,6 +231,14 @@ static const char *opcodes[] = {
 	[OP_RECV2] = "RECV2",
 	[OP_RECV3] = "RECV3",
 
+	[OP_ALOAD] = "ALOAD",
+	[OP_ASTORE] = "ASTORE",
+
+	[OP_LOAD] = "LOAD",
+	[OP_SAVE] = "SAVE",
+	[OP_SEND] = "SEND",
+	[OP_RECV] = "RECV",
+
 	[OP_HALT] = "HALT",
 };
 
@@ -249,18 +288,297 @@ getvar(Context *ctx, Token *tok)
 	return ctx->nvars++;
 }
 
+/* Return the array# associated with id, or -1 if there is none */
+static int
+findarray(Context *ctx, size_t id)
+{
+	for (int i = 0; i < ctx->narrays; i++) {
+		if (id == ctx->arrays[i].id) return i;
+	}
+
+	return -1;
+}
+
 const char *
 opstr(Opcode op)
 {
 	return opcodes[op];
 }
 
+/* Return whether the instruction at ins uses only block's variables,
+ * ports and array bytes. Its operands are known to be within the code. */
+static bool
+operands_ok(const CodeBlock *block, const uint8_t *ins)
+{
+	switch (ins[0]) {
+	case OP_LOAD0: case OP_LOAD1: case OP_LOAD2: case OP_LOAD3:
+		return ins[0] - OP_LOAD0 < block->nvars;
+	case OP_SAVE0: case OP_SAVE1: case OP_SAVE2: case OP_SAVE3:
+		return ins[0] - OP_SAVE0 < block->nvars;
+	case OP_SEND0: case OP_SEND1: case OP_SEND2: case OP_SEND3:
+		return ins[0] - OP_SEND0 < block->nports;
+	case OP_RECV0: case OP_RECV1: case OP_RECV2: case OP_RECV3:
+		return ins[0] - OP_RECV0 < block->nports;
+	case OP_LOAD:
+	case OP_SAVE:
+		return ins[1] < block->nvars;
+	case OP_SEND:
+	case OP_RECV:
+		return ins[1] < block->nports;
+	case OP_ALOAD:
+	case OP_ASTORE:
+		return ins[1] + ins[2] < block->arrsize;
+	default:
+		return true;
+	}
+}
+
+/*
+ * Return the deepest the operand stack gets while running code, or -1
+ * if it can't be bounded. Every instruction has a fixed stack effect,
+ * so this walks each path through the code and records the depth at
+ * every address. Compiled statements leave the stack as they found it,
+ * so any address reached at two different depths (or an invalid
+ * instruction) means the code wasn't made by compile(). If block isn't
+ * NULL, an instruction using a variable, port, or array byte that block
+ * doesn't have is invalid too.
+ */
+static int
+walk_code(const uint8_t *code, uint16_t size, const CodeBlock *block)
+{
+	int *depths;
+	uint16_t *work;
+	size_t nwork = 0;
+	int max = 0;
+
+	if (size == 0) return 0;
+
+	depths = ecalloc(size, sizeof(*depths));
+	work = ecalloc(size, sizeof(*work));
+	for (size_t i = 0; i < size; i++)
+		depths[i] = -1;
+
+	depths[0] = 0;
+	work[nwork++] = 0;
+	while (nwork > 0) {
+		uint16_t addr = work[--nwork];
+		int depth = depths[addr];
+		int pops = 0, pushes = 0, advance = 1;
+		uint32_t next[2];
+		int nnext = 1;
+
+		switch (code[addr]) {
+		case OP_NOOP:
+		case OP_HALT:
+			break;
+		case OP_PUSH:
+			advance = 2;
+			pushes = 1;
+			break;
+		case OP_DUP:
+			pops = 1;
+			pushes = 2;
+			break;
+		case OP_POP:
+		case OP_SAVE0: case OP_SAVE1: case OP_SAVE2: case OP_SAVE3:
+		case OP_SEND0: case OP_SEND1: case OP_SEND2: case OP_SEND3:
+			pops = 1;
+			break;
+		case OP_NEG:
+		case OP_LNOT:
+		case OP_NOT:
+			pops = 1;
+			pushes = 1;
+			break;
+		case OP_LOR: case OP_LAND: case OP_OR: case OP_XOR:
+		case OP_AND: case OP_EQL: case OP_LSS: case OP_LTE:
+		case OP_SHL: case OP_SHR: case OP_ADD: case OP_SUB:
+		case OP_MUL: case OP_DIV: case OP_MOD:
+			pops = 2;
+			pushes = 1;
+			break;
+		case OP_JMP:
+		case OP_FJMP:
+			advance = 3;
+			pops = code[addr] == OP_FJMP;
+			break;
+		case OP_LOAD0: case OP_LOAD1: case OP_LOAD2: case OP_LOAD3:
+		case OP_RECV0: case OP_RECV1: case OP_RECV2: case OP_RECV3:
+			pushes = 1;
+			break;
+		case OP_LOAD:
+		case OP_RECV:
+			advance = 2;
+			pushes = 1;
+			break;
+		case OP_SAVE:
+		case OP_SEND:
+			advance = 2;
+			pops = 1;
+			break;
+		case OP_ALOAD:
+			advance = 3;
+			pops = 1;
+			pushes = 1;
+			break;
+		case OP_ASTORE:
+			advance = 3;
+			pops = 2;
+			break;
+		default:
+			goto unbounded;
+		}
+
+		if (depth < pops || addr + advance > size) goto unbounded;
+		if (block && !operands_ok(block, &code[addr])) goto unbounded;
+		depth += pushes - pops;
+		if (depth > max) max = depth;
+		if (max > STACK_MAX) goto unbounded;
+
+		/* Find the following instructions; execution wraps around
+		 * to the beginning at the end of the code. */
+		next[0] = addr + advance;
+		switch (code[addr]) {
+		case OP_HALT:
+			nnext = 0;
+			break;
+		case OP_JMP:
+			next[0] = code[addr+1] + (code[addr+2]<<8);
+			break;
+		case OP_FJMP:
+			next[nnext++] = code[addr+1] + (code[addr+2]<<8);
+			break;
+		default:
+			break;
+		}
+
+		for (int i = 0; i < nnext; i++) {
+			if (next[i] == size) next[i] = 0;
+			if (next[i] >= size) goto unbounded;
+			if (depths[next[i]] < 0) {
+				depths[next[i]] = depth;
+				work[nwork++] = (uint16_t) next[i];
+			} else if (depths[next[i]] != depth) {
+				goto unbounded;
+			}
+		}
+	}
+
+	free(work);
+	free(depths);
+	return max;
+
+unbounded:
+	free(work);
+	free(depths);
+	return -1;
+}
+
+/* Return the deepest the operand stack gets while running code, or
+ * STACK_MAX if it can't be bounded, which is the safe fallback for
+ * code that wasn't made by compile(). */
+uint16_t
+code_depth(const uint8_t *code, uint16_t size)
+{
+	int max = walk_code(code, size, NULL);
+
+	return max < 0 ? STACK_MAX : (uint16_t) max;
+}
+
+/*
+ * Check code that was compiled elsewhere, such as by an earlier run,
+ * before it runs. Return whether every instruction that block's code
+ * can reach is whole and valid, jumps within the code, and uses only
+ * the block's variables, ports, and array bytes, and whether its stack
+ * depth is bounded. If so, set block->depth to it.
+ */
+bool
+check_code(CodeBlock *block)
+{
+	int max = walk_code(block->code, block->size, block);
+
+	if (max < 0) return false;
+	block->depth = (uint16_t) max;
+	return true;
+}
+
 static uint16_t
 here(const Context *ctx)
 {
 	return (uint16_t) ctx->bytecode.len;
 }
 
+/*
+ * The line table is a series of (address delta, line delta) entries,
+ * starting from address 0 on line 0, much like a DWARF line program.
+ * Address deltas are unsigned LEB128 and line deltas zigzag-encoded
+ * LEB128, so that most entries fit in two bytes.
+ */
+static void
+put_leb(ByteVec *vec, uint32_t val)
+{
+	while (val >= 0x80) {
+		bytevec_append(vec, (uint8_t) (val | 0x80));
+		val >>= 7;
+	}
+	bytevec_append(vec, (uint8_t) val);
+}
+
+static bool
+get_leb(const uint8_t **p, const uint8_t *end, uint32_t *val)
+{
+	*val = 0;
+	for (int shift = 0; *p < end && shift < 32; shift += 7) {
+		uint8_t byte = *(*p)++;
+		*val |= (uint32_t) (byte & 0x7F) << shift;
+		if (!(byte & 0x80)) return true;
+	}
+
+	return false;
+}
+
+/* Return the line of the statement at addr, counted from the body's
+ * first line */
+int
+code_line(const uint8_t *lines, uint32_t linesize, uint16_t addr)
+{
+	const uint8_t *p = lines, *end = lines + linesize;
+	uint32_t at = 0, line = 0, daddr, dline;
+
+	while (get_leb(&p, end, &daddr) && get_leb(&p, end, &dline)) {
+		if (at + daddr > addr) break;
+		at += daddr;
+		line += (dline >> 1) ^ -(dline & 1);
+	}
+
+	return (int) line;
+}
+
+/* Emit the pending line entry, if any code was assembled for it */
+static void
+flush_line(Context *ctx)
+{
+	uint32_t delta;
+
+	if (ctx->pend_line == ctx->line || ctx->pend_addr == here(ctx))
+		return;
+
+	delta = (uint32_t) (ctx->pend_line - ctx->line);
+	put_leb(&ctx->lines, ctx->pend_addr - ctx->line_addr);
+	put_leb(&ctx->lines, (delta << 1) ^ -(delta >> 31));
+	ctx->line_addr = ctx->pend_addr;
+	ctx->line = ctx->pend_line;
+}
+
+/* Record that the code assembled from here on is from lineno */
+static void
+mark_line(Context *ctx, int lineno)
+{
+	flush_line(ctx);
+	ctx->pend_addr = here(ctx);
+	ctx->pend_line = lineno - ctx->line0;
+}
+
 /* assemble a no-arg instruction */
 static void
 asm_op(Context *ctx, Opcode op)
@@ -276,6 +594,28 @@ asm_push(Context *ctx, uint8_t val)
 	bytevec_append(&ctx->bytecode, val);
 }
 
+/* Assemble an instruction on variable or port slot, in its short
+ * form if there is one */
+static void
+asm_slot(Context *ctx, Opcode op0, Opcode op, int slot)
+{
+	if (slot < SHORT_SLOTS) {
+		asm_op(ctx, op0 + slot);
+	} else {
+		asm_op(ctx, op);
+		bytevec_append(&ctx->bytecode, (uint8_t) slot);
+	}
+}
+
+/* Assemble an array access with its base and size operands */
+static void
+asm_array(Context *ctx, Opcode op, int arr)
+{
+	asm_op(ctx, op);
+	bytevec_append(&ctx->bytecode, (uint8_t) ctx->arrays[arr].base);
+	bytevec_append(&ctx->bytecode, (uint8_t) (ctx->arrays[arr].size - 1));
+}
+
 /* Evaluate an expression type and assemble any leftover instructions
  * to ensure the value of an expression is assembled */
 static void
@@ -286,7 +626,10 @@ asm_value(Context *ctx, Expression expr, Token *tok)
 		/* The expression is already assembled. */
 		break;
 	case EXPR_VAR:
-		asm_op(ctx, OP_LOAD0 + expr.idx);
+		asm_slot(ctx, OP_LOAD0, OP_LOAD, expr.idx);
+		break;
+	case EXPR_ELEM:
+		asm_array(ctx, OP_ALOAD, expr.idx);
 		break;
 	case EXPR_PORT:
 		send_error(&tok->pos, ERR, "ports are invalid operands outside send statements");
@@ -294,9 +637,46 @@ asm_value(Context *ctx, Expression expr, Token *tok)
 	case EXPR_SEND:
 		send_error(&tok->pos, ERR, "send statements are not expressions");
 		break;
+	case EXPR_STORE:
+		send_error(&tok->pos, ERR, "array stores are not expressions");
+		break;
+	case EXPR_DECL:
+		send_error(&tok->pos, ERR, "array declarations are not expressions");
+		break;
 	}
 }
 
+/* Assemble the current value of an assignable expression, keeping an
+ * element's index on the stack underneath for asm_store(). */
+static void
+asm_load(Context *ctx, Expression expr)
+{
+	if (expr.type == EXPR_ELEM) {
+		asm_op(ctx, OP_DUP);
+		asm_array(ctx, OP_ALOAD, expr.idx);
+	} else {
+		asm_slot(ctx, OP_LOAD0, OP_LOAD, expr.idx);
+	}
+}
+
+/* Store the value on top of the stack into an assignable expression */
+static void
+asm_store(Context *ctx, Expression expr)
+{
+	if (expr.type == EXPR_ELEM)
+		asm_array(ctx, OP_ASTORE, expr.idx);
+	else
+		asm_slot(ctx, OP_SAVE0, OP_SAVE, expr.idx);
+}
+
+/* Pop whatever value an expression statement leaves behind */
+static void
+asm_discard(Context *ctx, Expression expr)
+{
+	if (expr.type == EXPR_NORMAL || expr.type == EXPR_ELEM)
+		asm_op(ctx, OP_POP);
+}
+
 /* patch in an address for a jump instruction */
 static void
 patch_addr(Context *ctx, uint16_t idx, uint16_t addr)
@@ -333,8 +713,9 @@ asm_jump2(Context *ctx, Opcode op)
 static void
 push_scope(Context *ctx)
 {
-	Scope *scope = ecalloc(1, sizeof(*scope));
+	Scope *scope = arena_alloc(&ctx->arena, sizeof(*scope));
 	scope->parent = ctx->scope;
+	scope->breaks.arena = &ctx->arena;
 	scope->continue_addr = here(ctx);
 
 	ctx->scope = scope;
@@ -366,9 +747,7 @@ pop_scope(Context *ctx)
 		patch_here(ctx, breaks->buf[i]);
 	}
 
-	addrvec_clear(breaks);
 	ctx->scope = scope->parent;
-	free(ctx->scope);
 }
 
 /* Find or create a Label struct with the appropriate id */
@@ -381,13 +760,16 @@ find_label(Context *ctx, size_t id)
 
 	/* Expand the label vector when necessary */
 	if (ctx->nlabels == ctx->labelcap) {
+		size_t oldcap = ctx->labelcap;
 		ctx->labelcap = ctx->labelcap ? ctx->labelcap*2 : 8;
-		ctx->labels = erealloc(ctx->labels,
+		ctx->labels = arena_realloc(&ctx->arena, ctx->labels,
+			oldcap * sizeof(*ctx->labels),
 			ctx->labelcap * sizeof(*ctx->labels));
 	}
 
 	/* Initialize the new label struct and return its pointer */
 	ctx->labels[ctx->nlabels].id = id;
+	ctx->labels[ctx->nlabels].gotos.arena = &ctx->arena;
 	return &ctx->labels[ctx->nlabels++];
 }
 
@@ -409,6 +791,66 @@ asm_goto(Context *ctx, Token *labeltok)
 	label->some_goto = labeltok->pos;
 }
 
+/* Declare a new array named by tok, sized by the following number */
+static Expression
+declare_array(Context *ctx, Token *tok)
+{
+	Token num;
+	size_t size;
+	Array *arr;
+
+	expect(ctx->s, NUMBER, &num);
+	expect(ctx->s, RBRACKET, NULL);
+	if (!(size = parse_size(&num, ARRAY_BYTES)))
+		return (Expression){EXPR_DECL, 0};
+
+	if (ctx->narrays == ARRAY_MAX) {
+		send_error(&tok->pos, ERR,
+			"too many arrays (maximum is %d)", ARRAY_MAX);
+	} else if (ctx->arrsize + size > ARRAY_BYTES) {
+		send_error(&tok->pos, ERR,
+			"arrays too large (maximum is %d bytes in total)", ARRAY_BYTES);
+	} else {
+		arr = &ctx->arrays[ctx->narrays++];
+		arr->id = sym_id(ctx->dict, tok->lit);
+		arr->base = ctx->arrsize;
+		arr->size = (uint16_t) size;
+		ctx->arrsize += (uint16_t) size;
+	}
+
+	return (Expression){EXPR_DECL, 0};
+}
+
+/* Assemble the index of an array element. The first time an array's
+ * name appears, it's a declaration instead. */
+static Expression
+element(Context *ctx, Token *tok)
+{
+	size_t id = sym_id(ctx->dict, tok->lit);
+	int arr = findarray(ctx, id);
+	Expression index;
+	Token start;
+
+	expect(ctx->s, LBRACKET, &start);
+	if (arr < 0) {
+		for (int i = 0; i < ctx->nvars; i++) {
+			if (id == ctx->vars[i]) {
+				send_error(&tok->pos, ERR,
+					"variable %s is not an array", tok->lit);
+				break;
+			}
+		}
+
+		return declare_array(ctx, tok);
+	}
+
+	index = parse_expr(ctx, PREC_NONE);
+	asm_value(ctx, index, &start);
+	expect(ctx->s, RBRACKET, NULL);
+
+	return (Expression){EXPR_ELEM, arr};
+}
+
 /* assemble a primary expression */
 static Expression
 primary(Context *ctx, Token *tok)
@@ -418,6 +860,13 @@ primary(Context *ctx, Token *tok)
 		asm_push(ctx, parse_int(tok));
 		return (Expression){EXPR_NORMAL, 0};
 	case VARIABLE:
+		if (peektype(ctx->s) == LBRACKET)
+			return element(ctx, tok);
+		if (findarray(ctx, sym_id(ctx->dict, tok->lit)) >= 0) {
+			send_error(&tok->pos, ERR,
+				"array %s used without an index", tok->lit);
+			return (Expression){EXPR_NORMAL, 0};
+		}
 		return (Expression){EXPR_VAR, getvar(ctx, tok)};
 	case PORT:
 		return (Expression){EXPR_PORT, getport(ctx, tok)};
@@ -468,26 +917,30 @@ prefix(Context *ctx, Token *tok)
 			asm_op(ctx, OP_NOT);
 			break;
 		case INC:
-			if (base.type != EXPR_VAR)
+			if (base.type != EXPR_VAR && base.type != EXPR_ELEM) {
 				send_error(&tok->pos, ERR, "variable requried as increment operand");
+				break;
+			}
 
 			/* Quite a few instructions for increment/decrement. I
 			 * can always make OP_INC# later if I feel like I need
 			 * the performance boost. */
-			asm_op(ctx, OP_LOAD0 + base.idx);
+			asm_load(ctx, base);
 			asm_push(ctx, 1);
 			asm_op(ctx, OP_ADD);
-			asm_op(ctx, OP_SAVE0 + base.idx);
-			return base;
+			asm_store(ctx, base);
+			return base.type == EXPR_ELEM ? (Expression){EXPR_STORE, 0} : base;
 		case DEC:
-			if (base.type != EXPR_VAR)
+			if (base.type != EXPR_VAR && base.type != EXPR_ELEM) {
 				send_error(&tok->pos, ERR, "variable required as decrement operand");
+				break;
+			}
 
-			asm_op(ctx, OP_LOAD0 + base.idx);
+			asm_load(ctx, base);
 			asm_push(ctx, 1);
 			asm_op(ctx, OP_SUB);
-			asm_op(ctx, OP_SAVE0 + base.idx);
-			return base;
+			asm_store(ctx, base);
+			return base.type == EXPR_ELEM ? (Expression){EXPR_STORE, 0} : base;
 		default:
 			send_error(&tok->pos, ERR, "compiler bug: unimplemented unary operator");
 			break;
@@ -504,24 +957,25 @@ send(Context *ctx, Expression left, Token *tok)
 
 	if (right.type == EXPR_PORT) {
 		/* ($var | %port) <- %port */
-		asm_op(ctx, OP_RECV0 + right.idx);
+		asm_slot(ctx, OP_RECV0, OP_RECV, right.idx);
 
 		switch (left.type) {
 		case EXPR_VAR:
-			asm_op(ctx, OP_SAVE0 + left.idx);
+		case EXPR_ELEM:
+			asm_store(ctx, left);
 			break;
 		case EXPR_PORT:
-			asm_op(ctx, OP_SEND0 + left.idx);
+			asm_slot(ctx, OP_SEND0, OP_SEND, left.idx);
 			break;
 		default:
 			send_error(&tok->pos, ERR,
-				"variable or port required as left operand when receiving a message");
+				"variable, element, or port required as left operand when receiving a message");
 			break;
 		}
 	} else if (left.type == EXPR_PORT) {
 		/* %port <- expr */
 		asm_value(ctx, right, tok);
-		asm_op(ctx, OP_SEND0 + left.idx);
+		asm_slot(ctx, OP_SEND0, OP_SEND, left.idx);
 	} else {
 		send_error(&tok->pos, ERR,
 			"send statement requries a port operand, but can't find any");
@@ -538,8 +992,7 @@ comma(Context *ctx, Expression left, Token *tok)
 {
 	(void)tok;
 
-	if (left.type == EXPR_NORMAL)
-		asm_op(ctx, OP_POP);
+	asm_discard(ctx, left);
 	return parse_expr(ctx, PREC_COMMA);
 }
 
@@ -623,17 +1076,19 @@ assign(Context *ctx, Expression left, Token *tok)
 {
 	Expression right;
 
-	if (left.type != EXPR_VAR)
+	if (left.type != EXPR_VAR && left.type != EXPR_ELEM) {
 		send_error(&tok->pos, ERR,
 			"variable required as left operand of assignment");
+		return left;
+	}
 
 	if (ASSIGN == tok->type) {
 		/* -1 for LTR parsing */
 		right = parse_expr(ctx, PREC_ASSIGN-1);
 		asm_value(ctx, right, tok);
-		asm_op(ctx, OP_SAVE0 + left.idx);
+		asm_store(ctx, left);
 	} else {
-		asm_op(ctx, OP_LOAD0 + left.idx);
+		asm_load(ctx, left);
 		/* -1 for LTR parsing */
 		right = parse_expr(ctx, PREC_ASSIGN-1);
 		asm_value(ctx, right, tok);
@@ -674,10 +1129,12 @@ assign(Context *ctx, Expression left, Token *tok)
 			break;
 		}
 
-		asm_op(ctx, OP_SAVE0 + left.idx);
+		asm_store(ctx, left);
 	}
 
-	return left;
+	/* An element's index is consumed by the store, so unlike a
+	 * variable it can't be reloaded as the assignment's value. */
+	return left.type == EXPR_ELEM ? (Expression){EXPR_STORE, 0} : left;
 }
 
 /* Compile a conditional expression */
@@ -709,12 +1166,16 @@ cond(Context *ctx, Expression left, Token *tok)
 static Expression
 postfix(Context *ctx, Expression left, Token *tok)
 {
-	(void)ctx;
-	if (left.type != EXPR_VAR)
+	if (left.type != EXPR_VAR && left.type != EXPR_ELEM) {
 		send_error(&tok->pos, ERR, "operator required as postfix operand");
+		return (Expression){EXPR_NORMAL, 0};
+	}
 
-	asm_op(ctx, OP_LOAD0 + left.idx);
-	asm_op(ctx, OP_DUP);
+	/* There's no way to keep an element's old value beneath its
+	 * index, so element postfixes are statements like prefixes. */
+	asm_load(ctx, left);
+	if (left.type == EXPR_VAR)
+		asm_op(ctx, OP_DUP);
 	asm_push(ctx, 1);
 
 	switch (tok->type) {
@@ -729,8 +1190,10 @@ postfix(Context *ctx, Expression left, Token *tok)
 		break;
 	}
 
-	asm_op(ctx, OP_SAVE0 + left.idx);
+	asm_store(ctx, left);
 
+	if (left.type == EXPR_ELEM)
+		return (Expression){EXPR_STORE, 0};
 	return (Expression){EXPR_NORMAL, 0};
 }
 
@@ -808,9 +1271,9 @@ parse_block_stmt(Context *ctx)
 	Scanner *s = ctx->s;
 
 	expect(s, LBRACE, NULL);
-	while (RBRACE != peektype(s))
+	while (RBRACE != peektype(s) && TOK_EOF != peektype(s))
 		parse_stmt(ctx);
-	scan(s, NULL);
+	expect(s, RBRACE, NULL);
 }
 
 static void
@@ -850,18 +1313,18 @@ parse_for_stmt(Context *ctx)
 	Expression expr;
 	Token tok;
 	uint16_t body_jump, end_jump;
-	uint16_t post_addr;
+	uint16_t cond_addr, post_addr;
 
 	expect(s, FOR, NULL);
 	expect(s, LPAREN, NULL);
 
 	/* initial */
 	expr = parse_expr(ctx, PREC_NONE);
-	if (expr.type == EXPR_NORMAL)
-		asm_op(ctx, OP_POP);
+	asm_discard(ctx, expr);
 	expect(s, SEMICOLON, NULL);
 
 	/* conditional */
+	cond_addr = here(ctx);
 	peek(s, &tok);
 	expr = parse_expr(ctx, PREC_NONE);
 	asm_value(ctx, expr, &tok);
@@ -875,9 +1338,8 @@ parse_for_stmt(Context *ctx)
 	/* post-body */
 	post_addr = here(ctx);
 	expr = parse_expr(ctx, PREC_NONE);
-	if (expr.type == EXPR_NORMAL)
-		asm_op(ctx, OP_POP);
-	asm_continue(ctx, OP_JMP);
+	asm_discard(ctx, expr);
+	asm_jump(ctx, OP_JMP, cond_addr);
 	expect(s, RPAREN, NULL);
 
 	/* body */
@@ -922,15 +1384,17 @@ parse_do_stmt(Context *ctx)
 
 	push_scope(ctx);
 	parse_stmt(ctx);
-	pop_scope(ctx);
 
 	expect(s, WHILE, NULL);
 	expect(s, LPAREN, &tok);
 
+	/* The loop's own scope is still current, so that the jump back
+	 * goes to the top of this loop, and breaks land past it. */
 	cond = parse_expr(ctx, PREC_NONE);
 	asm_value(ctx, cond, &tok);
 	asm_op(ctx, OP_LNOT);
 	asm_continue(ctx, OP_FJMP);
+	pop_scope(ctx);
 
 	expect(s, RPAREN, NULL);
 	expect(s, SEMICOLON, NULL);
@@ -954,8 +1418,7 @@ parse_expr_stmt(Context *ctx)
 	expect(ctx->s, SEMICOLON, NULL);
 
 	/* Pop any remaining value */
-	if (expr.type == EXPR_NORMAL)
-		asm_op(ctx, OP_POP);
+	asm_discard(ctx, expr);
 }
 
 static void
@@ -963,6 +1426,7 @@ parse_stmt(Context *ctx)
 {
 	Token tok;
 	peek(ctx->s, &tok);
+	mark_line(ctx, tok.pos.lineno);
 
 	switch (tok.type) {
 	case BREAK:
@@ -1006,7 +1470,8 @@ parse_stmt(Context *ctx)
 				tokstr(tok.type), tok.lit);
 
 			/* Zap to nearest semicolon or rbrace. */
-			while (tok.type != RBRACE && tok.type != SEMICOLON)
+			while (tok.type != RBRACE && tok.type != SEMICOLON &&
+			       tok.type != TOK_EOF)
 				scan(ctx->s, &tok);
 		}
 		break;
@@ -1019,8 +1484,12 @@ compile(Scanner *s, SymDict *dict, CodeBlock *block)
 	Token tok;
 	Context ctx = {.s = s, .dict = dict};
 
+	ctx.bytecode.arena = &ctx.arena;
+	ctx.lines.arena = &ctx.arena;
 	peek(s, &tok); /* Record the beginning position for later */
+	ctx.line0 = tok.pos.lineno;
 	parse_block_stmt(&ctx);
+	flush_line(&ctx);
 
 	/* Resolve all gotos */
 	for (size_t i = 0; i < ctx.nlabels; i++) {
@@ -1033,9 +1502,7 @@ compile(Scanner *s, SymDict *dict, CodeBlock *block)
 		for (size_t j = 0; j < label->gotos.len; j++) {
 			patch_addr(&ctx, label->gotos.buf[j], label->addr);
 		}
-		addrvec_clear(&label->gotos);
 	}
-	free(ctx.labels);
 
 	/* Verify that the byte vector fits a 16-bit number */
 	if (ctx.bytecode.len > UINT16_MAX) {
@@ -1043,12 +1510,25 @@ compile(Scanner *s, SymDict *dict, CodeBlock *block)
 			"processor too complex; bytecode generated too large");
 	}
 
-	/* Record all port IDs */
+	/* Record all port and variable IDs */
 	memcpy(block->ports, ctx.ports, sizeof(ctx.ports));
 	block->nports = ctx.nports;
+	memcpy(block->vars, ctx.vars, sizeof(ctx.vars));
+	block->nvars = ctx.nvars;
+	block->arrsize = ctx.arrsize;
 
-	/* Shrink the byte vector and return the result */
-	bytevec_shrink(&ctx.bytecode);
+	/* Copy the bytecode out of the arena and return the result */
 	block->size = here(&ctx);
-	block->code = ctx.bytecode.buf;
+	block->code = ecalloc(block->size, 1);
+	if (block->size)
+		memcpy(block->code, ctx.bytecode.buf, block->size);
+	block->depth = code_depth(block->code, block->size);
+
+	block->line = ctx.line0;
+	block->linesize = (uint32_t) ctx.lines.len;
+	block->lines = ecalloc(block->linesize + 1, 1);
+	if (block->linesize)
+		memcpy(block->lines, ctx.lines.buf, block->linesize);
+
+	arena_release(&ctx.arena);
 }
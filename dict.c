@@ -24,13 +24,22 @@ sym_id(SymDict *dict, const char *sym)
 
 	/* No strings matched; add a new one to the array. */
 	if (dict->len == dict->cap) {
+		size_t oldcap = dict->cap;
 		dict->cap = dict->cap ? dict->cap*2 : 8;
-		dict->syms = erealloc(dict->syms,
-			dict->cap * sizeof(*dict->syms));
+		if (dict->arena) {
+			dict->syms = arena_realloc(dict->arena, dict->syms,
+				oldcap * sizeof(*dict->syms),
+				dict->cap * sizeof(*dict->syms));
+		} else {
+			dict->syms = erealloc(dict->syms,
+				dict->cap * sizeof(*dict->syms));
+		}
 	}
 
 	size_t result = dict->len++;
-	dict->syms[result] = ecalloc(1, strlen(sym)+1); /* +1 for '\0' */
+	size_t size = strlen(sym)+1; /* +1 for '\0' */
+	dict->syms[result] = dict->arena ?
+		arena_alloc(dict->arena, size) : ecalloc(1, size);
 	strcpy(dict->syms[result], sym);
 
 	return result;
@@ -43,13 +52,21 @@ const char
 	return dict->syms[id];
 }
 
+/* Free the dictionary's symbols, unless they belong to an arena, and
+ * reset it to its zero value. */
 void
 clear_dict(SymDict *dict)
 {
-	for (size_t i = 0; i < dict->len; i++) {
-		free(dict->syms[i]);
+	Arena *arena = dict->arena;
+
+	if (!arena) {
+		for (size_t i = 0; i < dict->len; i++) {
+			free(dict->syms[i]);
+		}
+
+		free(dict->syms);
 	}
 
-	free(dict->syms);
 	memset(dict, 0, sizeof(*dict));
+	dict->arena = arena;
 }
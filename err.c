@@ -7,6 +7,10 @@
  * filename:line:col, as well as printing the line number and a caret
  * under the offending token, should be a good enough complement
  * to the error.
+ *
+ * Runtime errors, and compile errors too many or too fatal to go on
+ * from, end the program. A caller that wants to go on instead, like
+ * the fuzzers, gives catch_errors() a jmp_buf to longjmp to.
  */
 #include <err.h>
 #include <stdio.h>
@@ -27,13 +31,72 @@ static struct {
 	const char *fname;
 	FILE *f;
 	int nerrors;
+
+	/* File offset of the start of each line, indexed by the
+	 * scanner as it reads (lines[0] is line 1). */
+	long *lines;
+	int nlines;
+	int linecap;
+
+	jmp_buf *recover; /* where to go instead of exiting, or NULL */
 } Globals = {0};
 
+/* Start reporting errors in a new source file */
 void
 init_error(FILE *f, const char *fname)
 {
 	Globals.f = f;
 	Globals.fname = fname;
+	Globals.nerrors = 0;
+	Globals.nlines = 0;
+}
+
+/* Make errors that would end the program longjmp to env instead. Pass
+ * NULL to exit on them again. */
+void
+catch_errors(jmp_buf *env)
+{
+	Globals.recover = env;
+}
+
+/* End the program, or jump back to the catch_errors() caller */
+static void
+bail(void)
+{
+	if (Globals.recover) longjmp(*Globals.recover, 1);
+	exit(1);
+}
+
+/* Report an error in a running program, and stop it */
+void
+runtime_error(const char *fmt, ...)
+{
+	va_list ap;
+
+	fflush(stdout);
+	va_start(ap, fmt);
+	vwarnx(fmt, ap);
+	va_end(ap);
+	bail();
+}
+
+/*
+ * Record that line #lineno starts at offset in the source. Lines are
+ * indexed in order as the scanner first reaches them; rescanning a
+ * line that's already indexed is a no-op.
+ */
+void
+index_line(int lineno, long offset)
+{
+	if (lineno != Globals.nlines+1) return;
+
+	if (Globals.nlines == Globals.linecap) {
+		Globals.linecap = Globals.linecap ? Globals.linecap*2 : 64;
+		Globals.lines = erealloc(Globals.lines,
+			Globals.linecap * sizeof(*Globals.lines));
+	}
+
+	Globals.lines[Globals.nlines++] = offset;
 }
 
 /*
@@ -43,21 +106,23 @@ init_error(FILE *f, const char *fname)
 static bool
 iscolor(void)
 {
+	const char *term = getenv("TERM");
+
 	/* If stringmatching `xterm-color` and `*-256color` is good enough for
 	 * Debian's .bashrc, then stringmatching `*color*` should be a good
      * enough heuristic for detecting a color terminal without using
      * ioctl or tput magic.
      */
-	return isatty(STDERR_FILENO) &&
-		strstr(getenv("TERM"), "color");
+	return isatty(STDERR_FILENO) && term && strstr(term, "color");
 }
 
 void
 send_error(const Position *pos, ErrorType type, const char *fmt, ...)
 {
 	const char *typestr = NULL;
-	char linebuf[80];
+	ByteVec line = {0};
 	long offset;
+	int c;
 	va_list ap;
 
 	/* Flush stdout so that it doesn't mangle with stderr. */
@@ -94,30 +159,26 @@ send_error(const Position *pos, ErrorType type, const char *fmt, ...)
 	va_end(ap);
 
 	/* Skip printing the offending line if we can't seek to it. */
-	if (fseek(Globals.f, 0, SEEK_CUR) != 0) return;
-
+	if (!pos || pos->lineno < 1 || pos->lineno > Globals.nlines) goto exit;
+	if (fseek(Globals.f, 0, SEEK_CUR) != 0) goto exit;
 
+	/* Seek straight to the line and read it in full. */
 	offset = ftell(Globals.f); /* preserve seek pos for later. */
-	rewind(Globals.f);
-	for (int curline = 1; curline < pos->lineno; ) {
-			/* keep consuming lines until we get to our line. */
-		fgets(linebuf, sizeof(linebuf), Globals.f);
-		if (strchr(linebuf, '\n')) curline++;
-	}
-	/* fetch our line */
-	fgets(linebuf, sizeof(linebuf), Globals.f);
-
-	/* Print the offending line and a caret to its column */
-	printf("%s", linebuf);
+	fseek(Globals.f, Globals.lines[pos->lineno-1], SEEK_SET);
+	while ((c = getc(Globals.f)) != EOF && c != '\n')
+		bytevec_append(&line, c);
 	fseek(Globals.f, offset, SEEK_SET);
 
+	/* Print the offending line and a caret to its column */
+	if (line.len) fwrite(line.buf, 1, line.len, stderr);
+	putc('\n', stderr);
 
-	if ((size_t)pos->colno >= sizeof(linebuf) || linebuf[pos->colno] == '\n') {
-		/* Error at end of line or too far right; don't post caret */
+	if ((size_t)pos->colno >= line.len) {
+		/* Error at end of line; don't post caret */
 		fprintf(stderr, "\n");
 	} else {
 		for (int i = 0; i < pos->colno; i++) {
-			if (linebuf[i] == '\t') {
+			if (line.buf[i] == '\t') {
 				putc('\t', stderr);
 			} else {
 				putc(' ', stderr);
@@ -125,17 +186,22 @@ send_error(const Position *pos, ErrorType type, const char *fmt, ...)
 		}
 		fprintf(stderr, "^\n");
 	}
+	free(line.buf);
 
+exit:
 	switch (type) {
 	case WARN:
 		break;
 	case ERR:
-		if (++Globals.nerrors > ERROR_MAX)
-			errx(1, "too many errors.");
+		if (++Globals.nerrors > ERROR_MAX) {
+			warnx("too many errors.");
+			bail();
+		}
 		break;
 	case FATAL:
 		/* Fatal errors mean the program should die */
-		errx(1, "fatal error.");
+		warnx("fatal error.");
+		bail();
 		break;
 	}
 }
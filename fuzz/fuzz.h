@@ -0,0 +1,24 @@
+/*
+ * fuzz - fuzzing entry points
+ *
+ * Each fuzz_*.c defines the libFuzzer entry point for one target. A
+ * build with clang -fsanitize=fuzzer links it straight into libFuzzer;
+ * any other build links it with main.c, which replays inputs from
+ * files instead.
+ */
+#ifndef FUZZ_H
+#define FUZZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Limits that keep a single input fast */
+enum
+{
+	FUZZ_INPUT_MAX = 1<<16,
+	FUZZ_INSTRS = 1<<20,
+};
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+#endif /* FUZZ_H */
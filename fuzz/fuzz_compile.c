@@ -0,0 +1,47 @@
+/*
+ * fuzz_compile - fuzz the scanner and compiler
+ *
+ * The input is compiled as a processor body. Compile errors are
+ * expected; the compiler just mustn't crash, hang, or produce code that
+ * code_depth() can't follow.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../noded.h"
+#include "fuzz.h"
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	Arena arena = {0};
+	SymDict dict = {.arena = &arena};
+	CodeBlock *block;
+	Scanner s;
+	jmp_buf env;
+	FILE *f;
+
+	if (size == 0 || size > FUZZ_INPUT_MAX) return 0;
+	if (!(f = fmemopen((void *) data, size, "r"))) return 0;
+
+	/* On the heap, since a longjmp may leave a local indeterminate */
+	block = ecalloc(1, sizeof(*block));
+	init_error(f, "fuzz");
+	catch_errors(&env);
+	if (setjmp(env) == 0) {
+		init_scanner(&s, f);
+		compile(&s, &dict, block);
+	}
+	catch_errors(NULL);
+
+	free(block->code);
+	free(block->lines);
+	free(block);
+	clear_dict(&dict);
+	arena_release(&arena);
+	fclose(f);
+	return 0;
+}
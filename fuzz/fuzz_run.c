@@ -0,0 +1,120 @@
+/*
+ * fuzz_run - fuzz the VM
+ *
+ * The input is compiled as a processor body, like fuzz_compile. If it
+ * compiles, it runs as two processors sharing that code, A and B,
+ * whose ports are wired to each other and to a buffer, a stack and a
+ * small bounded queue, so that sends and receives reach every kind of
+ * port rule and can block. The run is cut off after FUZZ_INSTRS
+ * instructions. Runtime errors are fine; crashes and hangs aren't.
+ *
+ * Port p of A goes to, by p%4: port p of B, the buffer's %elm or %idx,
+ * the stack, or the queue. B's other ports go to the same nodes in a
+ * different order, so that A and B contend for them.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../noded.h"
+#include "fuzz.h"
+
+enum
+{
+	NODE_A,
+	NODE_B,
+	NODE_BUF,
+	NODE_STACK,
+	NODE_QUEUE,
+	NUM_NODES,
+};
+
+/* Wire port p of processor node to port p of B (kind 0), the buffer
+ * (1), the stack (2) or the queue (3) */
+static void
+wire_port(VM *vm, size_t node, int p, int kind)
+{
+	switch (kind) {
+	case 0:
+		add_wire(vm, node, p, NODE_B, p);
+		break;
+	case 1:
+		add_wire(vm, node, p, NODE_BUF, (p / 4) % 2 ? BUFFER_IDX : BUFFER_ELM);
+		break;
+	case 2:
+		add_wire(vm, node, p, NODE_STACK, STACK_ELM);
+		break;
+	case 3:
+		add_wire(vm, node, p, NODE_QUEUE, QUEUE_ELM);
+		break;
+	}
+}
+
+static void
+run_block(const CodeBlock *block)
+{
+	VM *vm = ecalloc(1, sizeof(*vm));
+	size_t nwires = 0;
+	jmp_buf env;
+
+	/* A's port p and B's port p share a wire when p%4 == 0 */
+	for (int p = 0; p < block->nports; p++)
+		nwires += p % 4 == 0 ? 1 : 2;
+
+	vm_init(vm, NUM_NODES, nwires);
+	set_instr_budget(vm, FUZZ_INSTRS);
+	add_proc_node(vm, block);
+	copy_proc_node(vm, NODE_A);
+	add_buf_node(vm, ecalloc(BUFFER_NODE_MAX, 1), false);
+	add_stack_node(vm);
+	add_queue_node(vm, 4);
+
+	for (int p = 0; p < block->nports; p++) {
+		wire_port(vm, NODE_A, p, p % 4);
+		if (p % 4 != 0) wire_port(vm, NODE_B, p, p % 3 + 1);
+	}
+
+	catch_errors(&env);
+	if (setjmp(env) == 0) run(vm);
+	catch_errors(NULL);
+
+	vm_free(vm);
+	free(vm);
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	Arena arena = {0};
+	SymDict dict = {.arena = &arena};
+	CodeBlock *block;
+	Scanner s;
+	jmp_buf env;
+	FILE *f;
+
+	if (size == 0 || size > FUZZ_INPUT_MAX) return 0;
+	if (!(f = fmemopen((void *) data, size, "r"))) return 0;
+
+	/* On the heap, since a longjmp may leave a local indeterminate */
+	block = ecalloc(1, sizeof(*block));
+	init_error(f, "fuzz");
+	catch_errors(&env);
+	if (setjmp(env) == 0) {
+		init_scanner(&s, f);
+		compile(&s, &dict, block);
+	}
+	catch_errors(NULL);
+
+	if (!has_errors() && block->code)
+		run_block(block);
+
+	free(block->code);
+	free(block->lines);
+	free(block);
+	clear_dict(&dict);
+	arena_release(&arena);
+	fclose(f);
+	return 0;
+}
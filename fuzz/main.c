@@ -0,0 +1,79 @@
+/*
+ * main - replay fuzz inputs without libFuzzer
+ *
+ *   fuzz_TARGET FILE|DIR...
+ *
+ * Runs each file, and each file in each directory, through the target's
+ * entry point once. It's for reproducing a crash from a saved input and
+ * for running the seed corpus as a test where libFuzzer isn't
+ * available; it doesn't generate inputs of its own.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "fuzz.h"
+
+static void
+replay_file(const char *path)
+{
+	uint8_t *data = malloc(FUZZ_INPUT_MAX);
+	size_t size;
+	FILE *f;
+
+	if (!data) err(1, "malloc");
+	if (!(f = fopen(path, "rb"))) err(1, "%s", path);
+	size = fread(data, 1, FUZZ_INPUT_MAX, f);
+	if (ferror(f)) err(1, "%s", path);
+	fclose(f);
+
+	fprintf(stderr, "replaying %s\n", path);
+	LLVMFuzzerTestOneInput(data, size);
+	free(data);
+}
+
+static void
+replay(const char *path)
+{
+	struct stat st;
+	struct dirent *ent;
+	DIR *dir;
+
+	if (stat(path, &st) < 0) err(1, "%s", path);
+	if (!S_ISDIR(st.st_mode)) {
+		replay_file(path);
+		return;
+	}
+
+	if (!(dir = opendir(path))) err(1, "%s", path);
+	while ((ent = readdir(dir))) {
+		size_t len = strlen(path) + strlen(ent->d_name) + 2;
+		char *sub;
+
+		if (ent->d_name[0] == '.') continue;
+		sub = malloc(len);
+		if (!sub) err(1, "malloc");
+		snprintf(sub, len, "%s/%s", path, ent->d_name);
+		replay(sub);
+		free(sub);
+	}
+	closedir(dir);
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s FILE|DIR...\n", argv[0]);
+		return 1;
+	}
+
+	for (int i = 1; i < argc; i++)
+		replay(argv[i]);
+	return 0;
+}
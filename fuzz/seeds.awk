@@ -0,0 +1,51 @@
+# seeds.awk - cut a program's processor bodies out into seed inputs
+#
+#   awk -v dir=DIR -v prefix=NAME -f fuzz/seeds.awk FILE.nod
+#
+# Writes each processor body in FILE.nod, braces included, to
+# DIR/NAME-1.nod, DIR/NAME-2.nod and so on, since both fuzz targets
+# compile their input as a body. Braces inside comments, strings and
+# character literals are skipped when matching them up.
+
+function flush() {
+	if (body == "") return
+	n++
+	file = dir "/" prefix "-" n ".nod"
+	printf "%s\n", body >file
+	close(file)
+	body = ""
+}
+
+/^[ \t]*processor[ \t]/ && depth == 0 { want = 1 }
+
+{
+	quote = ""
+	for (i = 1; i <= length($0); i++) {
+		c = substr($0, i, 1)
+		if (depth == 0 && !(want && c == "{")) continue
+		want = 0
+
+		if (quote != "") {
+			if (c == "\\") {
+				body = body c substr($0, i + 1, 1)
+				i++
+				continue
+			}
+			if (c == quote) quote = ""
+		} else if (c == "\"" || c == "'") {
+			quote = c
+		} else if (substr($0, i, 2) == "//") {
+			body = body substr($0, i)
+			break
+		} else if (c == "{") {
+			depth++
+		} else if (c == "}") {
+			depth--
+		}
+
+		body = body c
+		if (depth == 0) flush()
+	}
+	if (depth > 0) body = body "\n"
+	else want = 0
+}
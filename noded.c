@@ -2,12 +2,19 @@
  * noded - Noded bytecode interpreter
  */
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "noded.h"
 
+/* Microseconds of CPU time between samples, for --sample */
+enum { SAMPLE_INTERVAL = 1000 };
+
 /*
  * The VM recognizes ports as an index from 0 to PORT_MAX-1. The compiler
  * fills out an array mapping each port's name (as an id from sym_id())
@@ -17,11 +24,217 @@
 typedef struct NodeRule NodeRule;
 struct NodeRule {
 	size_t id;
-	size_t ports[PORT_MAX];
+	size_t ports[ROUTE_MAX+1]; /* enough for any node type */
 	int nports;
 	bool is_proc;
 };
 
+/*
+ * Processor bodies that compile to the same code and port layout share
+ * one code buffer, the same way that `processor b = a;` copies share
+ * their source's code. Generated programs declare thousands of nodes
+ * from a handful of templates, so this keeps them to a handful of
+ * buffers.
+ */
+typedef struct SharedCode SharedCode;
+struct SharedCode {
+	uint64_t hash;
+	CodeBlock block;
+};
+
+/*
+ * In lazy mode, the loader only records where each processor body is
+ * and which ports it uses. The body is compiled by load_lazy() the
+ * first time the VM schedules a processor running it, which for a body
+ * that starts by receiving is when it's first sent a value. Until then
+ * only its tokens and braces are checked, so errors in a body that never
+ * runs aren't reported.
+ */
+typedef struct LazyBody LazyBody;
+struct LazyBody {
+	Scanner *s;
+	SymDict *dict;
+	ScanMark *mark; /* freed once the body is compiled */
+	uint64_t porthash; /* of the scanned ports, to check compile()'s */
+	int nports;
+	int wait_port;
+
+	/* Once compiled, what the VM needs of the CodeBlock */
+	bool compiled;
+	uint8_t *code;
+	uint16_t size;
+	uint16_t depth;
+	uint16_t arrsize;
+	int nvars;
+	uint8_t *lines;
+	uint32_t linesize;
+	int line;
+};
+
+/* Module-global variables */
+static struct {
+	SharedCode *codes;
+	size_t len;
+	size_t cap;
+
+	/* Open-addressed index of codes by hash: each slot holds an index
+	 * into codes plus one, or 0 if it's empty. Its size is a power of
+	 * two, kept at least twice len. */
+	size_t *slots;
+	size_t nslots;
+} Shared = {0};
+
+/* What lazily-compiled bodies need until the last one is compiled */
+static struct {
+	size_t pending; /* bodies not compiled yet */
+	Arena *arena; /* the program load's */
+} Lazy = {0};
+
+static struct {
+	bool lazy;
+	size_t stack_cap; /* 0 for no limit */
+	uint64_t max_instrs; /* 0 for no limit */
+	FILE *profile; /* JSON profile output, or NULL */
+	FILE *opstats; /* CSV dispatch counts, or NULL */
+	FILE *sample; /* folded stack samples, or NULL */
+	FILE *trace; /* Chrome trace events, or NULL */
+	bool time_phases;
+	const char *stats_file; /* periodic stats output, or NULL */
+	unsigned stats_interval; /* seconds between stats writes */
+} Options = {.stats_interval = 1};
+
+static uint64_t
+hash_block(const CodeBlock *block)
+{
+	uint64_t hash = HASH_INIT;
+
+	hash = hash_bytes(hash, &block->size, sizeof(block->size));
+	hash = hash_bytes(hash, block->code, block->size);
+	hash = hash_bytes(hash, &block->nports, sizeof(block->nports));
+	hash = hash_bytes(hash, block->ports,
+		block->nports * sizeof(*block->ports));
+	return hash;
+}
+
+static bool
+same_block(const CodeBlock *a, const CodeBlock *b)
+{
+	return a->size == b->size &&
+		a->nports == b->nports &&
+		memcmp(a->ports, b->ports, a->nports * sizeof(*a->ports)) == 0 &&
+		memcmp(a->code, b->code, a->size) == 0;
+}
+
+/* Double the index of shared code, or create it */
+static void
+grow_shared_slots(void)
+{
+	size_t mask;
+
+	free(Shared.slots);
+	Shared.nslots = Shared.nslots ? Shared.nslots*2 : 16;
+	Shared.slots = ecalloc(Shared.nslots, sizeof(*Shared.slots));
+	mask = Shared.nslots - 1;
+	for (size_t i = 0; i < Shared.len; i++) {
+		size_t slot = Shared.codes[i].hash & mask;
+		while (Shared.slots[slot])
+			slot = (slot + 1) & mask;
+		Shared.slots[slot] = i + 1;
+	}
+}
+
+/*
+ * If an identical block was already loaded, free block's code and
+ * point it at the earlier block's code instead. Otherwise, remember
+ * block for later bodies to share.
+ */
+static void
+share_code(CodeBlock *block)
+{
+	uint64_t hash = hash_block(block);
+	size_t mask, slot;
+
+	if (Shared.len*2 >= Shared.nslots)
+		grow_shared_slots();
+
+	mask = Shared.nslots - 1;
+	for (slot = hash & mask; Shared.slots[slot]; slot = (slot + 1) & mask) {
+		SharedCode *shared = &Shared.codes[Shared.slots[slot] - 1];
+		if (shared->hash == hash && same_block(&shared->block, block)) {
+			free(block->code);
+			block->code = shared->block.code;
+			return;
+		}
+	}
+
+	if (Shared.len == Shared.cap) {
+		Shared.cap = Shared.cap ? Shared.cap*2 : 8;
+		Shared.codes = erealloc(Shared.codes,
+			Shared.cap * sizeof(*Shared.codes));
+	}
+
+	Shared.codes[Shared.len].hash = hash;
+	Shared.codes[Shared.len].block = *block;
+	Shared.slots[slot] = ++Shared.len;
+}
+
+/* Free what loading the program needed, once no body needs it */
+static void
+release_load(Arena *arena)
+{
+	free(Shared.codes);
+	free(Shared.slots);
+	memset(&Shared, 0, sizeof(Shared));
+	arena_release(arena);
+}
+
+/* CodeLoader for processors added in lazy mode */
+static const CodeBlock *
+load_lazy(void *dat)
+{
+	static CodeBlock block; /* the VM copies what it needs right away */
+	LazyBody *body = dat;
+
+	if (!body->compiled) {
+		Phase prev = enter_phase(PHASE_COMPILE);
+
+		reset_scanner(body->s, body->mark);
+		free(body->mark);
+		body->mark = NULL;
+		compile_cached(body->s, body->dict, &block);
+		if (has_errors()) exit(1);
+
+		if (block.nports != body->nports ||
+		    hash_bytes(HASH_INIT, block.ports,
+		               block.nports * sizeof(*block.ports)) != body->porthash)
+			errx(1, "load_lazy(): compiled ports differ from scanned ports");
+
+		share_code(&block);
+		body->compiled = true;
+		body->code = block.code;
+		body->size = block.size;
+		body->depth = block.depth;
+		body->arrsize = block.arrsize;
+		body->nvars = block.nvars;
+		body->lines = block.lines;
+		body->linesize = block.linesize;
+		body->line = block.line;
+		if (--Lazy.pending == 0) release_load(Lazy.arena);
+		enter_phase(prev);
+		return &block;
+	}
+
+	block.code = body->code;
+	block.size = body->size;
+	block.depth = body->depth;
+	block.arrsize = body->arrsize;
+	block.nvars = body->nvars;
+	block.lines = body->lines;
+	block.linesize = body->linesize;
+	block.line = body->line;
+	return &block;
+}
+
 /*
  * Search through the NodeRules, and if one is found,
  * set *idx (if non-NULL) to the index, and then return the node rule
@@ -56,12 +269,73 @@ find_port(NodeRule *rule, size_t port_id)
  * specific to a singular declaration.
  */
 
+/*
+ * Consume a processor body. If block is non-NULL, record the ports the
+ * body uses into it, in the same order compile() would number them.
+ * Its variables and labels are added to dict too, so that they sit
+ * early in it, as they would had the body been compiled now. Then set
+ * *wait_port to the port the body first receives from, if it starts
+ * with `$var <- %port;` or `%out <- %port;`, or else to -1.
+ */
 static void
-skip_processor(Scanner *s)
+skip_body(Scanner *s, SymDict *dict, CodeBlock *block, int *wait_port)
 {
+	static const TokenType recv_first[] = {
+		LBRACE, VARIABLE, SEND, PORT, SEMICOLON,
+	};
+	const int nrecv = sizeof(recv_first)/sizeof(*recv_first);
 	Token tok;
-	int depth;
+	size_t id;
+	int depth = 0, ntoks = 0, port = -1;
+	bool matched = true;
+	int i;
+
+	do {
+		scan(s, &tok);
+		if (ntoks < nrecv) {
+			matched &= tok.type == recv_first[ntoks] ||
+				(ntoks == 1 && tok.type == PORT);
+			ntoks++;
+		}
 
+		switch(tok.type) {
+		case LBRACE: depth++; break;
+		case RBRACE: depth--; break;
+		case TOK_EOF:
+			send_error(&tok.pos, ERR, "EOF reached within node block");
+			depth = 0;
+			break;
+		case VARIABLE:
+		case IDENTIFIER:
+			if (block) sym_id(dict, tok.lit);
+			break;
+		case PORT:
+			if (!block) break;
+
+			id = sym_id(dict, tok.lit);
+			for (i = 0; i < block->nports; i++) {
+				if (block->ports[i] == id) break;
+			}
+			if (i == block->nports) {
+				if (block->nports == PORT_MAX) {
+					send_error(&tok.pos, ERR,
+						"too many ports (maximum is %d)", PORT_MAX);
+					break;
+				}
+				block->ports[block->nports++] = id;
+			}
+			if (ntoks == 4) port = i;
+			break;
+		default: break;
+		}
+	} while (depth > 0);
+
+	if (wait_port) *wait_port = matched && ntoks == nrecv ? port : -1;
+}
+
+static void
+skip_processor(Scanner *s)
+{
 	expect(s, PROCESSOR, NULL);
 	expect(s, IDENTIFIER, NULL);
 	switch(peektype(s)) {
@@ -71,22 +345,10 @@ skip_processor(Scanner *s)
 		expect(s, SEMICOLON, NULL);
 		break;
 	case LBRACE:
-		depth = 0;
-		do {
-			scan(s, &tok);
-			switch(tok.type) {
-			case LBRACE: depth++; break;
-			case RBRACE: depth--; break;
-			case TOK_EOF:
-				send_error(&tok.pos, ERR, "EOF reached within node block");
-				depth = 0;
-				break;
-			default: break;
-			}
-		} while (depth > 0);
+		skip_body(s, NULL, NULL, NULL);
 		break;
 	default:
-		send_error(&s->peek.pos, ERR, "unexpected token %s", tokstr(tok.type));
+		send_error(&s->peek.pos, ERR, "unexpected token %s", tokstr(s->peek.type));
 		break;
 	}
 }
@@ -97,6 +359,8 @@ skip_buffer(Scanner *s)
 	expect(s, BUFFER, NULL);
 	expect(s, IDENTIFIER, NULL);
 	expect(s, ASSIGN, NULL);
+	if (peektype(s) == IDENTIFIER)
+		expect(s, IDENTIFIER, NULL); /* file */
 	expect(s, STRING, NULL);
 	expect(s, SEMICOLON, NULL);
 }
@@ -109,6 +373,60 @@ skip_stack(Scanner *s)
 	expect(s, SEMICOLON, NULL);
 }
 
+static void
+skip_memory(Scanner *s)
+{
+	expect(s, MEMORY, NULL);
+	expect(s, IDENTIFIER, NULL);
+	expect(s, LBRACKET, NULL);
+	expect(s, NUMBER, NULL);
+	expect(s, RBRACKET, NULL);
+	if (peektype(s) == INC)
+		expect(s, INC, NULL);
+	if (peektype(s) == ASSIGN) {
+		expect(s, ASSIGN, NULL);
+		expect(s, IDENTIFIER, NULL); /* file */
+		expect(s, STRING, NULL);
+	}
+	expect(s, SEMICOLON, NULL);
+}
+
+/* Skip a broadcast or merge node */
+static void
+skip_route(Scanner *s, TokenType type)
+{
+	expect(s, type, NULL);
+	expect(s, IDENTIFIER, NULL);
+	expect(s, LBRACKET, NULL);
+	expect(s, NUMBER, NULL);
+	expect(s, RBRACKET, NULL);
+	expect(s, SEMICOLON, NULL);
+}
+
+/* Skip an input, output, or fd node */
+static void
+skip_stream(Scanner *s, TokenType type)
+{
+	expect(s, type, NULL);
+	expect(s, IDENTIFIER, NULL);
+	expect(s, ASSIGN, NULL);
+	expect(s, type == FD ? NUMBER : STRING, NULL);
+	expect(s, SEMICOLON, NULL);
+}
+
+static void
+skip_queue(Scanner *s)
+{
+	expect(s, QUEUE, NULL);
+	expect(s, IDENTIFIER, NULL);
+	if (peektype(s) == LBRACKET) {
+		expect(s, LBRACKET, NULL);
+		expect(s, NUMBER, NULL);
+		expect(s, RBRACKET, NULL);
+	}
+	expect(s, SEMICOLON, NULL);
+}
+
 static void
 skip_wire(Scanner *s)
 {
@@ -128,12 +446,104 @@ skip_wire(Scanner *s)
  * array.
  */
 
+/* Scan the `file "path"` initializer of a node, and return size bytes
+ * of storage loaded from the file, setting *mapped as map_file() does.
+ * `file` is only special here, so it isn't a keyword. */
+static uint8_t *
+scan_file(Scanner *s, size_t size, bool *mapped)
+{
+	Token keyword, path;
+	char fname[BUFFER_NODE_MAX+1] = {0};
+	uint8_t *data = NULL;
+
+	expect(s, IDENTIFIER, &keyword);
+	expect(s, STRING, &path);
+
+	if (strcmp(keyword.lit, "file") != 0) {
+		send_error(&keyword.pos, ERR,
+			"unexpected identifier %s", keyword.lit);
+	} else {
+		/* fname stays NUL-terminated, being one byte longer */
+		parse_string((uint8_t *) fname, &path);
+		if (!has_errors() && !(data = map_file(fname, size, mapped)))
+			send_error(&path.pos, ERR, "%s: %s", fname, strerror(errno));
+	}
+
+	if (data) return data;
+	*mapped = false;
+	return ecalloc(size, 1);
+}
+
+/*
+ * Scan an input, output, or fd node. Input and output nodes open the
+ * named file for reading or writing; an fd node takes over an open
+ * descriptor inherited from the parent process. All three read from
+ * %in and/or write to %out, like the IO node.
+ */
+static void
+scan_stream(Scanner *s, SymDict *dict, VM *vm, NodeRule *rules, size_t nrules,
+	TokenType type)
+{
+	Token name, value;
+	char fname[BUFFER_NODE_MAX+1] = {0};
+	int fd = -1;
+	NodeRule *rule = &rules[nrules];
+
+	expect(s, type, NULL);
+	expect(s, IDENTIFIER, &name);
+	expect(s, ASSIGN, NULL);
+	expect(s, type == FD ? NUMBER : STRING, &value);
+	expect(s, SEMICOLON, NULL);
+	if (has_errors()) return;
+
+	switch (type) {
+	case INPUT:
+		parse_string((uint8_t *) fname, &value);
+		fd = open(fname, O_RDONLY);
+		break;
+	case OUTPUT:
+		parse_string((uint8_t *) fname, &value);
+		fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		break;
+	default:
+		fd = parse_int(&value);
+		snprintf(fname, sizeof(fname), "file descriptor %d", fd);
+		if (fd >= 0 && fd <= STDERR_FILENO) {
+			send_error(&value.pos, ERR,
+				"%s belongs to the io node", fname);
+			return;
+		}
+		/* The VM gets its own descriptor to close */
+		fd = fcntl(fd, F_GETFL) < 0 ? -1 : dup(fd);
+		break;
+	}
+
+	if (fd < 0) {
+		send_error(&value.pos, ERR, "%s: %s", fname, strerror(errno));
+		return;
+	}
+
+	/* Add the file to the VM */
+	enter_phase(PHASE_VM);
+	add_file_node(vm, fd);
+	enter_phase(PHASE_SCAN);
+
+	/* Set up the rules for wiring */
+	rule->id = sym_id(dict, name.lit);
+	rule->nports = 0;
+	if (type != OUTPUT)
+		rule->ports[rule->nports++] = sym_id(dict, "in");
+	if (type != INPUT)
+		rule->ports[rule->nports++] = sym_id(dict, "out");
+}
+
 static void
 scan_processor(Scanner *s, SymDict *dict, VM *vm, NodeRule *rules, size_t nrules)
 {
 	Token name, source;
 	size_t source_id, source_idx;
 	CodeBlock block;
+	LazyBody *body;
 	NodeRule *rule = &rules[nrules]; /* this node's rule */
 	NodeRule *source_rule;
 
@@ -142,10 +552,37 @@ scan_processor(Scanner *s, SymDict *dict, VM *vm, NodeRule *rules, size_t nrules
 
 	switch (peektype(s)) {
 	case LBRACE:
-		compile(s, dict, &block);
-		add_proc_node(vm, block.code, block.size);
+		if (Options.lazy) {
+			body = ecalloc(1, sizeof(*body));
+			body->s = s;
+			body->dict = dict;
+			body->mark = mark_scanner(s);
+			block.nports = 0;
+			skip_body(s, dict, &block, &body->wait_port);
+			body->porthash = hash_bytes(HASH_INIT, block.ports,
+				block.nports * sizeof(*block.ports));
+			body->nports = block.nports;
+			Lazy.pending++;
+			enter_phase(PHASE_VM);
+			add_lazy_proc_node(vm, &load_lazy, body, body->nports,
+				body->wait_port);
+			enter_phase(PHASE_SCAN);
+
+			rule->id = sym_id(dict, name.lit);
+			memcpy(rule->ports, block.ports, sizeof(block.ports));
+			rule->nports = block.nports;
+			rule->is_proc = true;
+			break;
+		}
+
+		enter_phase(PHASE_COMPILE);
+		compile_cached(s, dict, &block);
+		if (!has_errors()) share_code(&block);
+		enter_phase(PHASE_VM);
+		add_proc_node(vm, &block);
+		enter_phase(PHASE_SCAN);
 		rule->id = sym_id(dict, name.lit);
-		memcpy(rule->ports, block.ports, sizeof(rule->ports));
+		memcpy(rule->ports, block.ports, sizeof(block.ports));
 		rule->nports = block.nports;
 		rule->is_proc = true;
 		break;
@@ -157,7 +594,9 @@ scan_processor(Scanner *s, SymDict *dict, VM *vm, NodeRule *rules, size_t nrules
 		source_id = sym_id(dict, source.lit);
 		source_rule = find_rule(rules, nrules, source_id, &source_idx);
 		if (source_rule) {
+			enter_phase(PHASE_VM);
 			copy_proc_node(vm, source_idx);
+			enter_phase(PHASE_SCAN);
 			if (!has_errors()) {
 				/* This node has the same exact rules as the previous node. */
 				*rule = *source_rule;
@@ -177,7 +616,8 @@ static void
 scan_buffer(Scanner *s, SymDict *dict, VM *vm, NodeRule *rules, size_t nrules)
 {
 	Token name, value;
-	uint8_t dat[BUFFER_NODE_MAX];
+	uint8_t *dat;
+	bool mapped = false;
 	NodeRule *rule;
 
 	size_t ports[] = {
@@ -188,12 +628,19 @@ scan_buffer(Scanner *s, SymDict *dict, VM *vm, NodeRule *rules, size_t nrules)
 	expect(s, BUFFER, NULL);
 	expect(s, IDENTIFIER, &name);
 	expect(s, ASSIGN, NULL);
-	expect(s, STRING, &value);
+	if (peektype(s) == IDENTIFIER) {
+		dat = scan_file(s, BUFFER_NODE_MAX, &mapped);
+	} else {
+		expect(s, STRING, &value);
+		dat = ecalloc(BUFFER_NODE_MAX, 1);
+		parse_string(dat, &value);
+	}
 	expect(s, SEMICOLON, NULL);
 
 	/* Add the buffer to the VM */
-	parse_string(dat, &value);
-	add_buf_node(vm, dat);
+	enter_phase(PHASE_VM);
+	add_buf_node(vm, dat, mapped);
+	enter_phase(PHASE_SCAN);
 
 	/* Set up the rules for wiring */
 	rule = &rules[nrules];
@@ -217,7 +664,134 @@ scan_stack(Scanner *s, SymDict *dict, VM *vm, NodeRule *rules, size_t nrules)
 	expect(s, SEMICOLON, NULL);
 
 	/* Add the stack to the VM */
+	enter_phase(PHASE_VM);
 	add_stack_node(vm);
+	enter_phase(PHASE_SCAN);
+
+	/* Set up the rules for wiring */
+	rule = &rules[nrules];
+	rule->id = sym_id(dict, name.lit);
+	memcpy(rule->ports, ports, sizeof(ports));
+	rule->nports = sizeof(ports)/sizeof(*ports);
+}
+
+static void
+scan_memory(Scanner *s, SymDict *dict, VM *vm, NodeRule *rules, size_t nrules)
+{
+	Token name, size;
+	size_t nbytes;
+	bool autoinc = false;
+	uint8_t *dat;
+	bool mapped = false;
+	NodeRule *rule;
+
+	size_t ports[] = {
+		[MEMORY_ELM] = sym_id(dict, "elm"),
+		[MEMORY_LO] = sym_id(dict, "lo"),
+		[MEMORY_HI] = sym_id(dict, "hi"),
+	};
+
+	expect(s, MEMORY, NULL);
+	expect(s, IDENTIFIER, &name);
+	expect(s, LBRACKET, NULL);
+	expect(s, NUMBER, &size);
+	expect(s, RBRACKET, NULL);
+	if (peektype(s) == INC) {
+		expect(s, INC, NULL);
+		autoinc = true;
+	}
+
+	nbytes = parse_size(&size, MEMORY_MAX);
+	if (nbytes == 0) nbytes = 1; /* already reported */
+	if (peektype(s) == ASSIGN) {
+		expect(s, ASSIGN, NULL);
+		dat = scan_file(s, nbytes, &mapped);
+	} else {
+		dat = ecalloc(nbytes, 1);
+	}
+	expect(s, SEMICOLON, NULL);
+
+	/* Add the memory to the VM */
+	enter_phase(PHASE_VM);
+	add_mem_node(vm, nbytes, autoinc, dat, mapped);
+	enter_phase(PHASE_SCAN);
+
+	/* Set up the rules for wiring */
+	rule = &rules[nrules];
+	rule->id = sym_id(dict, name.lit);
+	memcpy(rule->ports, ports, sizeof(ports));
+	rule->nports = sizeof(ports)/sizeof(*ports);
+}
+
+/*
+ * Scan a broadcast or merge node. Both have one port on one side, and
+ * a declared number of ports on the other, named with the prefix and
+ * a number counting from 0 (in0, in1, ...).
+ */
+static void
+scan_route(Scanner *s, SymDict *dict, VM *vm, NodeRule *rules, size_t nrules,
+	TokenType type)
+{
+	Token name, count;
+	const char *prefix = type == BROADCAST ? "out" : "in";
+	char port[sizeof("out") + 3];
+	size_t n;
+	NodeRule *rule = &rules[nrules];
+
+	expect(s, type, NULL);
+	expect(s, IDENTIFIER, &name);
+	expect(s, LBRACKET, NULL);
+	expect(s, NUMBER, &count);
+	expect(s, RBRACKET, NULL);
+	expect(s, SEMICOLON, NULL);
+
+	n = parse_size(&count, ROUTE_MAX);
+
+	/* Add the node to the VM */
+	enter_phase(PHASE_VM);
+	if (type == BROADCAST) {
+		add_broadcast_node(vm);
+		rule->ports[BROADCAST_IN] = sym_id(dict, "in");
+	} else {
+		add_merge_node(vm);
+		rule->ports[MERGE_OUT] = sym_id(dict, "out");
+	}
+	enter_phase(PHASE_SCAN);
+
+	/* Set up the rules for wiring */
+	rule->id = sym_id(dict, name.lit);
+	for (size_t i = 0; i < n; i++) {
+		snprintf(port, sizeof(port), "%s%zu", prefix, i);
+		rule->ports[1 + i] = sym_id(dict, port);
+	}
+	rule->nports = (int) n + 1;
+}
+
+static void
+scan_queue(Scanner *s, SymDict *dict, VM *vm, NodeRule *rules, size_t nrules)
+{
+	Token name, capacity;
+	size_t cap = 0; /* unbounded */
+	NodeRule *rule;
+
+	size_t ports[] = {
+		[QUEUE_ELM] = sym_id(dict, "elm"),
+	};
+
+	expect(s, QUEUE, NULL);
+	expect(s, IDENTIFIER, &name);
+	if (peektype(s) == LBRACKET) {
+		expect(s, LBRACKET, NULL);
+		expect(s, NUMBER, &capacity);
+		expect(s, RBRACKET, NULL);
+		cap = parse_size(&capacity, QUEUE_MAX);
+	}
+	expect(s, SEMICOLON, NULL);
+
+	/* Add the queue to the VM */
+	enter_phase(PHASE_VM);
+	add_queue_node(vm, cap);
+	enter_phase(PHASE_SCAN);
 
 	/* Set up the rules for wiring */
 	rule = &rules[nrules];
@@ -230,6 +804,7 @@ static void
 scan_wire(Scanner *s, SymDict *dict, VM *vm, NodeRule *rules, size_t nrules)
 {
 	Token node1, port1, wire, node2, port2;
+	char wirename[4*(LITERAL_MAX+1) + sizeof(". -> .")];
 	size_t node1_id, node2_id;
 	size_t node1_idx = 0, node2_idx = 0;
 	bool has_proc = false;
@@ -277,13 +852,44 @@ scan_wire(Scanner *s, SymDict *dict, VM *vm, NodeRule *rules, size_t nrules)
 		return;
 	}
 
-	add_wire(vm, node1_idx, port1idx, node2_idx, port2idx);
+	snprintf(wirename, sizeof(wirename), "%s.%s -> %s.%s",
+		node1.lit, port1.lit, node2.lit, port2.lit);
+	name_wire(vm, add_wire(vm, node1_idx, port1idx, node2_idx, port2idx),
+		wirename);
+}
+
+static void
+usage(const char *argv0)
+{
+	fprintf(stderr, "usage: %s [--cache-dir DIR] [--lazy] "
+		"[--stack-cap BYTES] [--max-instructions N] [--profile FILE] "
+		"[--opstats FILE] [--sample FILE] [--trace FILE] [--time-phases] "
+		"[--stats-file FILE] [--stats-interval SECS] FILE\n", argv0);
+	exit(1);
+}
+
+/* Parse a byte count with an optional K, M, or G suffix */
+static size_t
+parse_bytes(const char *argv0, const char *arg)
+{
+	char *endptr;
+	unsigned long long val = strtoull(arg, &endptr, 10);
+
+	switch (*endptr) {
+	case 'G': case 'g': val <<= 10; /* fallthrough */
+	case 'M': case 'm': val <<= 10; /* fallthrough */
+	case 'K': case 'k': val <<= 10; endptr++; break;
+	default: break;
+	}
+
+	if (endptr == arg || *endptr != '\0') usage(argv0);
+	return (size_t) val;
 }
 
 int
 main(int argc, char *argv[])
 {
-	const char *fname;
+	const char *fname = NULL;
 	FILE *f;
 	Scanner s;
 
@@ -291,20 +897,78 @@ main(int argc, char *argv[])
 	size_t nwires = 0;
 
 	VM vm;
-	SymDict dict = {0};
+	Arena arena = {0}; /* lives as long as the program load */
+	SymDict dict = {.arena = &arena};
 	NodeRule *rules = NULL;
 	size_t nodes_parsed = 0;
 
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s FILE\n", argv[0]);
-		return 1;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--cache-dir") == 0) {
+			if (++i == argc) usage(argv[0]);
+			init_cache(argv[i]);
+		} else if (strcmp(argv[i], "--time-phases") == 0) {
+			Options.time_phases = true;
+		} else if (strcmp(argv[i], "--lazy") == 0) {
+			Options.lazy = true;
+		} else if (strcmp(argv[i], "--stack-cap") == 0) {
+			if (++i == argc) usage(argv[0]);
+			Options.stack_cap = parse_bytes(argv[0], argv[i]);
+		} else if (strcmp(argv[i], "--max-instructions") == 0) {
+			char *endptr;
+
+			if (++i == argc) usage(argv[0]);
+			Options.max_instrs = strtoull(argv[i], &endptr, 10);
+			if (endptr == argv[i] || *endptr != '\0') usage(argv[0]);
+		} else if (strcmp(argv[i], "--stats-file") == 0) {
+			if (++i == argc) usage(argv[0]);
+			Options.stats_file = argv[i];
+		} else if (strcmp(argv[i], "--stats-interval") == 0) {
+			char *endptr;
+			unsigned long secs;
+
+			if (++i == argc) usage(argv[0]);
+			secs = strtoul(argv[i], &endptr, 10);
+			if (endptr == argv[i] || *endptr != '\0' || secs == 0
+					|| secs > UINT_MAX)
+				usage(argv[0]);
+			Options.stats_interval = (unsigned) secs;
+		} else if (strcmp(argv[i], "--profile") == 0) {
+			if (++i == argc) usage(argv[0]);
+#ifdef PROFILE
+			if (!(Options.profile = fopen(argv[i], "w")))
+				err(1, "%s", argv[i]);
+#else
+			errx(1, "--profile needs a profiling build (make PROFILE=1)");
+#endif
+		} else if (strcmp(argv[i], "--sample") == 0) {
+			if (++i == argc) usage(argv[0]);
+			if (!(Options.sample = fopen(argv[i], "w")))
+				err(1, "%s", argv[i]);
+		} else if (strcmp(argv[i], "--trace") == 0) {
+			if (++i == argc) usage(argv[0]);
+			if (!(Options.trace = fopen(argv[i], "w")))
+				err(1, "%s", argv[i]);
+		} else if (strcmp(argv[i], "--opstats") == 0) {
+			if (++i == argc) usage(argv[0]);
+#ifdef OPSTATS
+			if (!(Options.opstats = fopen(argv[i], "w")))
+				err(1, "%s", argv[i]);
+#else
+			errx(1, "--opstats needs an opstats build (make OPSTATS=1)");
+#endif
+		} else if (argv[i][0] == '-' || fname) {
+			usage(argv[0]);
+		} else {
+			fname = argv[i];
+		}
 	}
+	if (!fname) usage(argv[0]);
 
-	fname = argv[1];
 	f = fopen(fname, "r");
 	if (f == NULL)
 		err(1, "%s", fname);
 
+	enter_phase(PHASE_PRESCAN);
 	init_error(f, fname);
 	init_scanner(&s, f);
 
@@ -325,6 +989,25 @@ main(int argc, char *argv[])
 			nnodes++;
 			skip_stack(&s);
 			break;
+		case MEMORY:
+			nnodes++;
+			skip_memory(&s);
+			break;
+		case BROADCAST:
+		case MERGE:
+			nnodes++;
+			skip_route(&s, peektype(&s));
+			break;
+		case INPUT:
+		case OUTPUT:
+		case FD:
+			nnodes++;
+			skip_stream(&s, peektype(&s));
+			break;
+		case QUEUE:
+			nnodes++;
+			skip_queue(&s);
+			break;
 		case IDENTIFIER:
 			nwires++;
 			skip_wire(&s);
@@ -338,10 +1021,14 @@ main(int argc, char *argv[])
 	if (has_errors()) return 1;
 
 	/* nnodes+1 to account for IO node */
+	enter_phase(PHASE_VM);
 	vm_init(&vm, nnodes, nwires);
-	rules = ecalloc(nnodes, sizeof(*rules));
+	set_stack_limit(&vm, Options.stack_cap);
+	set_instr_budget(&vm, Options.max_instrs);
+	rules = arena_alloc(&arena, nnodes * sizeof(*rules));
 
 	/* Rewind to the beginning and rescan, building everything up. */
+	enter_phase(PHASE_SCAN);
 	if (fseek(f, 0, SEEK_SET) < 0)
 		err(1, "%s", fname);
 	init_scanner(&s, f); /* re-initialize */
@@ -359,7 +1046,9 @@ main(int argc, char *argv[])
 		memcpy(rule->ports, io_ports, sizeof(io_ports));
 		rule->nports = sizeof(io_ports)/sizeof(*io_ports);
 
+		enter_phase(PHASE_VM);
 		add_io_node(&vm);
+		enter_phase(PHASE_SCAN);
 	}
 
 	/* Add all the nodes and wires */
@@ -377,8 +1066,29 @@ main(int argc, char *argv[])
 			scan_stack(&s, &dict, &vm, rules, nodes_parsed);
 			nodes_parsed++;
 			break;
+		case MEMORY:
+			scan_memory(&s, &dict, &vm, rules, nodes_parsed);
+			nodes_parsed++;
+			break;
+		case BROADCAST:
+		case MERGE:
+			scan_route(&s, &dict, &vm, rules, nodes_parsed, peektype(&s));
+			nodes_parsed++;
+			break;
+		case INPUT:
+		case OUTPUT:
+		case FD:
+			scan_stream(&s, &dict, &vm, rules, nodes_parsed, peektype(&s));
+			nodes_parsed++;
+			break;
+		case QUEUE:
+			scan_queue(&s, &dict, &vm, rules, nodes_parsed);
+			nodes_parsed++;
+			break;
 		case IDENTIFIER:
+			enter_phase(PHASE_WIRE);
 			scan_wire(&s, &dict, &vm, rules, nodes_parsed);
+			enter_phase(PHASE_SCAN);
 			break;
 		default:
 			send_error(&s.peek.pos, ERR,
@@ -389,9 +1099,53 @@ main(int argc, char *argv[])
 
 	if (has_errors()) return 1;
 
-	free(rules);
-	clear_dict(&dict);
+	enter_phase(PHASE_VM);
+	for (size_t i = 0; i < nodes_parsed; i++)
+		name_node(&vm, i, id_sym(&dict, rules[i].id));
+
+	/* Lazily-compiled bodies need these until the last is compiled */
+	if (Lazy.pending) Lazy.arena = &arena;
+	else release_load(&arena);
+	if (Options.sample) start_sampling(&vm, SAMPLE_INTERVAL);
+	if (Options.trace) {
+		trace_open(Options.trace);
+		start_tracing(&vm);
+	}
+	enter_phase(PHASE_WIRE);
+	link_vm(&vm);
+	start_stats(Options.stats_file, Options.stats_interval);
+	enter_phase(PHASE_RUN);
 	run(&vm);
+	enter_phase(PHASE_OTHER);
+	stop_stats();
+	if (Options.trace) {
+		trace_close();
+		fclose(Options.trace);
+	}
+	if (Options.sample) {
+		write_samples(&vm, Options.sample, fname);
+		fclose(Options.sample);
+	}
+#ifdef PROFILE
+	if (Options.profile) {
+		write_profile(&vm, Options.profile);
+		fclose(Options.profile);
+	}
+#endif
+#ifdef OPSTATS
+	if (Options.opstats) {
+		write_opstats(&vm, Options.opstats);
+		fclose(Options.opstats);
+	}
+#endif
+
+	if (Options.time_phases) write_phases(stderr);
+
+	if (Options.max_instrs && vm.ticks == Options.max_instrs) {
+		warnx("stopped after %llu instructions (--max-instructions)",
+			(unsigned long long) vm.ticks);
+		return 1;
+	}
 
 	/* don't free the VM's memory -- the OS collects the garbage anyway */
 	return 0;
@@ -1,6 +1,7 @@
 #ifndef NODED_H
 #define NODED_H
 
+#include <setjmp.h>  /* jmp_buf */
 #include <stdarg.h>  /* va_* */
 #include <stdbool.h> /* bool */
 #include <stddef.h>  /* size_t */
@@ -9,6 +10,9 @@
 
 #define DEBUG 1
 
+/* Starting value for hash_bytes() */
+#define HASH_INIT UINT64_C(0xcbf29ce484222325)
+
 typedef enum
 {
 	WARN,
@@ -26,8 +30,37 @@ enum
 	BUFFER_NODE_MAX = UINT8_MAX+1,
 	LITERAL_MAX = BUFFER_NODE_MAX*4, /* Max byte size for a literal.  */
 
-	PORT_MAX = 4,
-	VAR_MAX = 4,
+	PORT_MAX = 16,
+	VAR_MAX = UINT8_MAX+1,
+
+	/* Slots below SHORT_SLOTS have one-byte LOAD#/SAVE#/SEND#/RECV#
+	 * instructions; the rest take an operand byte. */
+	SHORT_SLOTS = 4,
+
+	/* A processor may declare up to ARRAY_MAX private arrays, of
+	 * ARRAY_BYTES bytes in total. */
+	ARRAY_MAX = 16,
+	ARRAY_BYTES = UINT8_MAX+1,
+
+	/* The largest operand stack a processor may have, used when a
+	 * processor's stack depth can't be bounded ahead of time. */
+	STACK_MAX = 512,
+
+	/* The largest capacity a queue node may be declared with */
+	QUEUE_MAX = 1<<16,
+
+	/* The largest size a memory node may be declared with; the
+	 * most that 16-bit addresses can reach. */
+	MEMORY_MAX = 1<<16,
+
+	/* The most outputs a broadcast node, or inputs a merge node,
+	 * may be declared with */
+	ROUTE_MAX = 16,
+
+	/* Bump BYTECODE_VERSION whenever the Opcode set or the
+	 * CodeBlock layout changes, so that stale cached code is
+	 * never loaded. */
+	BYTECODE_VERSION = 6,
 };
 
 typedef enum
@@ -43,6 +76,8 @@ typedef enum
 	RPAREN, /* ) */
 	LBRACE, /* { */
 	RBRACE, /* } */
+	LBRACKET, /* [ */
+	RBRACKET, /* ] */
 
 	COLON,     /* : */
 	COMMA,     /* , */
@@ -115,8 +150,15 @@ typedef enum
 	IF,
 	WHILE,
 
+	BROADCAST,
 	BUFFER,
+	FD,
+	INPUT,
+	MEMORY,
+	MERGE,
+	OUTPUT,
 	PROCESSOR,
+	QUEUE,
 	STACK,
 	keyword_end,
 
@@ -157,7 +199,7 @@ typedef enum
 	OP_JMP,
 	OP_FJMP,
 
-	/* OP_LOAD# should match the number of vars defined in VAR_MAX */
+	/* OP_LOAD# should match SHORT_SLOTS */
 	OP_LOAD0,
 	OP_LOAD1,
 	OP_LOAD2,
@@ -169,7 +211,7 @@ typedef enum
 	OP_SAVE2,
 	OP_SAVE3,
 
-	/* OP_SEND# should match the number of ports in PORT_MAX */
+	/* Same here */
 	OP_SEND0,
 	OP_SEND1,
 	OP_SEND2,
@@ -181,7 +223,21 @@ typedef enum
 	OP_RECV2,
 	OP_RECV3,
 
+	/* Private array access, followed by two operand bytes: the
+	 * array's base offset and its size minus one. */
+	OP_ALOAD,
+	OP_ASTORE,
+
+	/* Long forms of the above, followed by an operand byte with the
+	 * variable or port number. */
+	OP_LOAD,
+	OP_SAVE,
+	OP_SEND,
+	OP_RECV,
+
 	OP_HALT,
+
+	NUM_OPCODES,
 } Opcode;
 
 	
@@ -206,17 +262,64 @@ struct Scanner {
 
 	char chr;      /* Current character */
 	Position pos;
+	long offset;   /* File offset of the character after chr */
 
 	/* Peek buffer */
 	bool buffered;
 	Token peek;
 };
 
+/* A saved scanner state, for rewinding over a span of source. It
+ * keeps only as much of the peeked token's literal as there is, since
+ * lazy loading holds one for every processor body. */
+typedef struct ScanMark ScanMark;
+struct ScanMark {
+	char chr;
+	Position pos;
+	long offset;
+
+	bool buffered;
+	TokenType type; /* of the peeked token, if buffered */
+	Position peekpos;
+	char lit[]; /* the peeked token's literal */
+};
+
+/*
+ * The phases of loading and running a program. Allocations are
+ * tagged with the phase that's current when they're made, and
+ * phase.c times each phase, for --time-phases.
+ */
+typedef enum
+{
+	PHASE_OTHER,   /* anything outside the phases below */
+	PHASE_PRESCAN, /* noded's first pass, counting nodes and wires */
+	PHASE_SCAN,    /* reading declarations outside processor bodies */
+	PHASE_COMPILE,
+	PHASE_WIRE,    /* resolving wires to nodes, ports and pointers */
+	PHASE_VM,      /* setting up the VM and its nodes */
+	PHASE_RUN,
+	NUM_PHASES,
+} Phase;
+
+/* A bump allocator whose allocations are all freed together */
+typedef struct ArenaChunk ArenaChunk;
+typedef struct Arena Arena;
+struct Arena {
+	ArenaChunk *chunks;
+	size_t used; /* bytes handed out */
+	size_t size; /* bytes reserved from the system */
+};
+
+/*
+ * SymDicts and vectors allocate from arena if it's non-NULL, and from
+ * the heap otherwise.
+ */
 typedef struct SymDict SymDict;
 struct SymDict {
 	char **syms;
 	size_t len;
 	size_t cap;
+	Arena *arena;
 };
 
 typedef struct ByteVec ByteVec;
@@ -224,6 +327,7 @@ struct ByteVec {
 	uint8_t *buf;
 	size_t len;
 	size_t cap;
+	Arena *arena;
 };
 
 typedef struct AddrVec AddrVec;
@@ -231,15 +335,26 @@ struct AddrVec {
 	uint16_t *buf;
 	size_t len;
 	size_t cap;
+	Arena *arena;
 };
 
 typedef struct CodeBlock CodeBlock;
 struct CodeBlock {
 	uint8_t *code;
-	uint8_t size;
+	uint16_t size;
+	uint16_t depth; /* maximum operand stack depth */
+	uint16_t arrsize; /* bytes of private arrays */
+
+	/* The line table, decoded by code_line(), maps addresses to lines
+	 * counted from the body's opening brace on line `line`. */
+	uint8_t *lines;
+	uint32_t linesize;
+	int line;
 
 	size_t ports[PORT_MAX];
 	int nports;
+	size_t vars[VAR_MAX];
+	int nvars;
 };
 
 typedef enum
@@ -249,6 +364,11 @@ typedef enum
 	PROC_NODE,
 	BUFFER_NODE,
 	STACK_NODE,
+	QUEUE_NODE,
+	MEMORY_NODE,
+	BROADCAST_NODE,
+	MERGE_NODE,
+	FILE_NODE,
 } NodeType;
 
 typedef enum
@@ -269,6 +389,32 @@ typedef enum
 	STACK_ELM,
 } StackPorts;
 
+typedef enum
+{
+	QUEUE_ELM,
+} QueuePorts;
+
+typedef enum
+{
+	MEMORY_ELM,
+	MEMORY_LO,
+	MEMORY_HI,
+} MemoryPorts;
+
+/* Followed by out1, out2, ... up to the declared count */
+typedef enum
+{
+	BROADCAST_IN,
+	BROADCAST_OUT0,
+} BroadcastPorts;
+
+/* Followed by in1, in2, ... up to the declared count */
+typedef enum
+{
+	MERGE_OUT,
+	MERGE_IN0,
+} MergePorts;
+
 typedef enum
 {
 	EMPTY,
@@ -278,24 +424,120 @@ typedef enum
 
 typedef struct Wire Wire;
 struct Wire {
-	WireStatus status;
+	uint8_t status; /* a WireStatus */
 	uint8_t buf;
+	uint32_t id; /* index into vm->wirenames */
 };
 
+/* A node is stored in the VM's array for its type, at index idx. */
 typedef struct Node Node;
 struct Node {
 	NodeType type;
-	void *dat;
+	size_t idx;
+	char *name; /* for reports, or NULL */
 };
 
+/* Return the code for a processor that is compiled on demand. The
+ * VM copies what it needs from the block before calling again. */
+typedef const CodeBlock *(*CodeLoader)(void *dat);
+
+/* Defined in vm.c */
+typedef struct ProcNode ProcNode;
+typedef struct ProcLoader ProcLoader;
+typedef struct PortDecl PortDecl;
+typedef struct BufNode BufNode;
+typedef struct StackNode StackNode;
+typedef struct ChunkPool ChunkPool;
+typedef struct QueueNode QueueNode;
+typedef struct MemNode MemNode;
+typedef struct BroadcastNode BroadcastNode;
+typedef struct MergeNode MergeNode;
+typedef struct FileNode FileNode;
+typedef struct Profile Profile;
+typedef struct OpStats OpStats;
+
+/*
+ * Counters the VM always keeps, for a live look at a long run. The
+ * processor counts are as of the last complete sweep of run().
+ */
+typedef struct VMStats VMStats;
+struct VMStats {
+	uint64_t ticks;    /* instructions executed */
+	uint64_t messages; /* values sent by processors */
+	uint64_t bytes_in, bytes_out; /* through the IO node */
+	uint64_t runnable; /* processors that made progress */
+	uint64_t blocked;  /* processors that couldn't */
+	uint64_t halted;
+	uint64_t stack_bytes;   /* stack node chunks in memory, pooled or not */
+	uint64_t spilled_bytes; /* stack node chunks spilled to disk */
+};
+
+/*
+ * Nodes are laid out by type in contiguous arrays, so that the
+ * scheduler's sweep over processors is a linear scan through memory.
+ * The arrays grow while the program loads, and are fixed in place by
+ * the first run().
+ */
 typedef struct VM VM;
 struct VM {
 	Node *nodes;
 	size_t nnodes;
 	size_t nodes_added;
+
+	ProcNode *procs;     /* hot processor state */
+	ProcLoader *loaders; /* loaders and stack depths, parallel to procs */
+	PortDecl *decls;     /* PORT_MAX ports per processor, until linked */
+	size_t nprocs;
+	size_t proccap;
+
+	BufNode *bufs;
+	size_t nbufs;
+	size_t bufcap;
+
+	StackNode *stacks;
+	size_t nstacks;
+	size_t stackcap;
+	ChunkPool *pool; /* storage shared by every stack node */
+
+	QueueNode *queues;
+	size_t nqueues;
+	size_t queuecap;
+
+	MemNode *mems;
+	size_t nmems;
+	size_t memcap;
+
+	BroadcastNode *bcasts;
+	size_t nbcasts;
+	size_t bcastcap;
+
+	MergeNode *merges;
+	size_t nmerges;
+	size_t mergecap;
+
+	FileNode *files;
+	size_t nfiles;
+	size_t filecap;
+
 	Wire *wires;
 	size_t nwires;
 	size_t wires_added;
+	char **wirenames; /* for reports; NULL until named */
+
+	/* Filled in when the VM is linked by run() */
+	bool linked;
+	uint8_t *stackmem; /* every processor's operand stack */
+	void *portmem;     /* every processor's ports and wires */
+
+	uint64_t ticks;  /* instructions executed by every processor */
+	uint64_t budget; /* the most ticks run() may take, or 0 */
+
+#ifdef PROFILE
+	Profile *prof;
+#endif
+#ifdef OPSTATS
+	OpStats *opstats;
+#endif
 };
 
 
@@ -303,11 +545,28 @@ struct VM {
 
 void *ecalloc(size_t nmemb, size_t size);
 void *erealloc(void *ptr, size_t size);
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_realloc(Arena *arena, void *ptr, size_t oldsize, size_t size);
+void arena_release(Arena *arena);
+size_t arena_peak(void);
+void alloc_tag(Phase tag);
+void alloc_counts(Phase tag, uint64_t *allocs, uint64_t *bytes);
+uint8_t *map_file(const char *path, size_t size, bool *mapped);
+
+
+/* cache.c */
+
+uint64_t hash_bytes(uint64_t hash, const void *dat, size_t len);
+void init_cache(const char *dir);
+void compile_cached(Scanner *s, SymDict *dict, CodeBlock *block);
 
 
 /* compiler.c */
 
 const char *opstr(Opcode op);
+uint16_t code_depth(const uint8_t *code, uint16_t size);
+bool check_code(CodeBlock *block);
+int code_line(const uint8_t *lines, uint32_t linesize, uint16_t addr);
 void compile(Scanner *s, SymDict *dict, CodeBlock *block);
 
 
@@ -321,8 +580,17 @@ void clear_dict(SymDict *dict);
 /* err.c */
 
 void init_error(FILE *f, const char *fname);
+void catch_errors(jmp_buf *env);
+void runtime_error(const char *fmt, ...);
 void send_error(const Position *pos, ErrorType type, const char *fmt, ...);
 bool has_errors(void);
+void index_line(int lineno, long offset);
+
+
+/* phase.c */
+
+Phase enter_phase(Phase phase);
+void write_phases(FILE *f);
 
 
 /* parse.c */
@@ -330,6 +598,7 @@ bool has_errors(void);
 uint8_t parse_int(const Token *tok);
 uint8_t parse_char(const Token *tok);
 void parse_string(uint8_t dest[], const Token *tok);
+size_t parse_size(const Token *tok, size_t max);
 
 
 /* scanner.c */
@@ -340,6 +609,15 @@ void peek(Scanner *s, Token *dest);
 TokenType peektype(Scanner *s);
 void expect(Scanner *s, TokenType expected, Token *dest);
 void zap_to(Scanner *s, TokenType target);
+ScanMark *mark_scanner(const Scanner *s);
+void reset_scanner(Scanner *s, const ScanMark *mark);
+
+
+/* stats.c */
+
+void start_stats(const char *path, unsigned interval);
+void stop_stats(void);
+void write_stats(int fd);
 
 
 /* token.c */
@@ -348,6 +626,16 @@ TokenType lookup(char ident[]);
 const char *tokstr(TokenType type);
 
 
+/* trace.c */
+
+uint64_t trace_clock(void);
+void trace_open(FILE *f);
+void trace_thread(uint32_t tid, const char *name);
+void trace_span(uint32_t tid, const char *name, uint64_t start, uint64_t end);
+void trace_flow(uint32_t tid, const char *name, uint64_t id, bool start, uint64_t ts);
+void trace_close(void);
+
+
 /* vec.c */
 
 void bytevec_append(ByteVec *vec, uint8_t val);
@@ -361,13 +649,37 @@ void addrvec_clear(AddrVec *vec);
 /* vm.c */
 
 void vm_init(VM *vm, size_t nnodes, size_t nwires);
+void vm_free(VM *vm);
 void add_io_node(VM *vm);
-void add_proc_node(VM *vm, const uint8_t *code, uint16_t code_size);
+void add_proc_node(VM *vm, const CodeBlock *block);
+void add_lazy_proc_node(VM *vm, CodeLoader load, void *dat, int nports,
+	int wait_port);
 void copy_proc_node(VM *vm, size_t source_node);
-void add_buf_node(VM *vm, const uint8_t dat[]);
+void add_buf_node(VM *vm, uint8_t *data, bool mapped);
 void add_stack_node(VM *vm);
-void add_wire(VM *vm, size_t node1, int port1, size_t node2, int port2);
+void set_stack_limit(VM *vm, size_t bytes);
+void set_instr_budget(VM *vm, uint64_t n);
+void add_queue_node(VM *vm, size_t capacity);
+void add_mem_node(VM *vm, size_t size, bool autoinc, uint8_t *data,
+	bool mapped);
+void add_broadcast_node(VM *vm);
+void add_merge_node(VM *vm);
+void add_file_node(VM *vm, int fd);
+size_t add_wire(VM *vm, size_t node1, int port1, size_t node2, int port2);
+void name_node(VM *vm, size_t node, const char *name);
+void name_wire(VM *vm, size_t wire, const char *name);
+void link_vm(VM *vm);
+void vm_stats(VMStats *stats);
 void run(VM *vm);
+void start_sampling(const VM *vm, long interval_us);
+void write_samples(const VM *vm, FILE *f, const char *fname);
+void start_tracing(const VM *vm);
+#ifdef PROFILE
+void write_profile(const VM *vm, FILE *json);
+#endif
+#ifdef OPSTATS
+void write_opstats(const VM *vm, FILE *csv);
+#endif
 
 
 #endif /* NODED_H */
@@ -9,16 +9,176 @@
 
 #include "noded.h"
 
-/* Print disassembled code */
+/* A row of counts from `noded --opstats` */
+typedef struct Count Count;
+struct Count {
+	char *a;
+	char *b;
+	uint64_t count;
+};
+
+typedef struct CountVec CountVec;
+struct CountVec {
+	Count *buf;
+	size_t len;
+	size_t cap;
+};
+
+/* Module-global variables */
+static struct {
+	bool loaded;
+	CountVec ops;   /* a is the opcode */
+	CountVec pairs; /* a and b are the opcodes */
+	CountVec addrs; /* a is the processor, b the address */
+} Opstats = {0};
+
+static char *
+copy_field(const char *field)
+{
+	size_t len = strlen(field) + 1;
+	return memcpy(ecalloc(len, 1), field, len);
+}
+
+static void
+append_count(CountVec *vec, const char *a, const char *b, uint64_t count)
+{
+	if (vec->len == vec->cap) {
+		vec->cap = vec->cap ? vec->cap*2 : 64;
+		vec->buf = erealloc(vec->buf, vec->cap * sizeof(*vec->buf));
+	}
+
+	vec->buf[vec->len].a = copy_field(a);
+	vec->buf[vec->len].b = copy_field(b);
+	vec->buf[vec->len].count = count;
+	vec->len++;
+}
+
+/* Read the kind,a,b,count rows written by `noded --opstats` */
 static void
-disasm(CodeBlock *block)
+load_opstats(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	char line[2*LITERAL_MAX + 64];
+	char *fields[4];
+
+	if (!f) err(1, "%s", path);
+
+	while (fgets(line, sizeof(line), f)) {
+		int n = 0;
+
+		line[strcspn(line, "\n")] = '\0';
+		fields[n++] = line;
+		for (char *c = line; *c && n < 4; c++) {
+			if (*c == ',') {
+				*c = '\0';
+				fields[n++] = c + 1;
+			}
+		}
+		if (n < 4) continue;
+
+		if (strcmp(fields[0], "op") == 0)
+			append_count(&Opstats.ops, fields[1], fields[2],
+				strtoull(fields[3], NULL, 10));
+		else if (strcmp(fields[0], "pair") == 0)
+			append_count(&Opstats.pairs, fields[1], fields[2],
+				strtoull(fields[3], NULL, 10));
+		else if (strcmp(fields[0], "addr") == 0)
+			append_count(&Opstats.addrs, fields[1], fields[2],
+				strtoull(fields[3], NULL, 10));
+	}
+
+	fclose(f);
+	Opstats.loaded = true;
+}
+
+/* Return processor name's dispatch counts for each address, and their
+ * total in *total */
+static uint64_t *
+addr_counts(const char *name, uint16_t size, uint64_t *total)
+{
+	uint64_t *counts = ecalloc(size + 1, sizeof(*counts));
+
+	*total = 0;
+	for (size_t i = 0; i < Opstats.addrs.len; i++) {
+		Count *row = &Opstats.addrs.buf[i];
+		unsigned long addr = strtoul(row->b, NULL, 10);
+
+		if (strcmp(row->a, name) != 0 || addr >= size) continue;
+		counts[addr] += row->count;
+		*total += row->count;
+	}
+
+	return counts;
+}
+
+static int
+by_count(const void *a, const void *b)
+{
+	uint64_t x = ((const Count *)a)->count, y = ((const Count *)b)->count;
+	return (x < y) - (x > y);
+}
+
+/* Print the opcode histogram and the most common opcode pairs */
+static void
+report_opstats(void)
+{
+	enum { TOP_PAIRS = 16 };
+	uint64_t total = 0;
+
+	for (size_t i = 0; i < Opstats.ops.len; i++)
+		total += Opstats.ops.buf[i].count;
+	if (!total) return;
+
+	qsort(Opstats.ops.buf, Opstats.ops.len, sizeof(Count), &by_count);
+	qsort(Opstats.pairs.buf, Opstats.pairs.len, sizeof(Count), &by_count);
+
+	printf("Opcodes:\n");
+	for (size_t i = 0; i < Opstats.ops.len; i++) {
+		Count *row = &Opstats.ops.buf[i];
+		printf("\t%-8s %12llu %5.1f%%\n", row->a,
+			(unsigned long long) row->count,
+			100.0 * (double) row->count / (double) total);
+	}
+
+	printf("Opcode pairs:\n");
+	for (size_t i = 0; i < Opstats.pairs.len && i < TOP_PAIRS; i++) {
+		Count *row = &Opstats.pairs.buf[i];
+		printf("\t%-8s %-8s %12llu %5.1f%%\n", row->a, row->b,
+			(unsigned long long) row->count,
+			100.0 * (double) row->count / (double) total);
+	}
+}
+
+/* Print disassembled code, with each address's dispatch count if
+ * --opstats was given */
+static void
+disasm(CodeBlock *block, const char *name)
 {
 	uint16_t addr = 0;
+	uint64_t total = 0;
+	uint64_t *counts = NULL;
+	int line = -1;
+
+	if (Opstats.loaded)
+		counts = addr_counts(name, block->size, &total);
+
 	while (addr < block->size) {
 		uint8_t *instr = &block->code[addr];
 		int advance = 1;
 		uint16_t jmpaddr;
 
+		if (code_line(block->lines, block->linesize, addr) != line) {
+			line = code_line(block->lines, block->linesize, addr);
+			if (counts) printf("%19s", "");
+			printf("\t; line %d\n", block->line + line);
+		}
+
+		if (counts && counts[addr]) {
+			printf("%12llu %5.1f%%", (unsigned long long) counts[addr],
+				100.0 * (double) counts[addr] / (double) total);
+		} else if (counts) {
+			printf("%19s", "");
+		}
 		printf("\t0x%04x    %s", addr, opstr(instr[0]));
 		switch (instr[0]) {
 		case OP_PUSH:
@@ -31,6 +191,18 @@ disasm(CodeBlock *block)
 			jmpaddr = instr[1] + (instr[2]<<8);
 			printf("\t0x%04x\n", jmpaddr);
 			break;
+		case OP_LOAD:
+		case OP_SAVE:
+		case OP_SEND:
+		case OP_RECV:
+			advance = 2;
+			printf("\t%u\n", (unsigned) instr[1]);
+			break;
+		case OP_ALOAD:
+		case OP_ASTORE:
+			advance = 3;
+			printf("\t0x%02x 0x%02x\n", instr[1], instr[2]);
+			break;
 		default:
 			printf("\n");
 			break;
@@ -39,6 +211,10 @@ disasm(CodeBlock *block)
 		addr += advance;
 	}
 	printf("\t0x%04x    EOF\n", block->size);
+	printf("\tstack depth %u\n", (unsigned) block->depth);
+	if (block->arrsize)
+		printf("\tarray bytes %u\n", (unsigned) block->arrsize);
+	free(counts);
 }
 
 static void
@@ -55,11 +231,14 @@ report_processor(Scanner *s, SymDict *dict)
 	case LBRACE:
 		/* assumes compile returns non-NULL because
 		 * send_error() automatically exits */
-		compile(s, dict, &block);
+		enter_phase(PHASE_COMPILE);
+		compile_cached(s, dict, &block);
+		enter_phase(PHASE_SCAN);
 		if (has_errors()) break;
 
 		printf("Processor %s:\n", name.lit);
-		disasm(&block);
+		disasm(&block, name.lit);
+		free(block.lines);
 		free(block.code);
 		break;
 	case ASSIGN:
@@ -78,15 +257,19 @@ static void
 report_buffer(Scanner *s)
 {
 	Token name;
+	Token keyword = {0};
 	Token value;
 
 	expect(s, BUFFER, NULL);
 	expect(s, IDENTIFIER, &name);
 	expect(s, ASSIGN, NULL);
+	if (peektype(s) == IDENTIFIER)
+		expect(s, IDENTIFIER, &keyword); /* file */
 	expect(s, STRING, &value);
 	expect(s, SEMICOLON, NULL);
 
-	printf("Buffer %s = \"%s\"\n", name.lit, value.lit);
+	printf("Buffer %s = %s%s\"%s\"\n", name.lit, keyword.lit,
+		keyword.lit[0] ? " " : "", value.lit);
 }
 
 static void
@@ -101,6 +284,97 @@ report_stack(Scanner *s)
 	printf("Stack %s\n", name.lit);
 }
 
+static void
+report_memory(Scanner *s)
+{
+	Token name;
+	Token size;
+	Token path = {0};
+	bool autoinc = false;
+
+	expect(s, MEMORY, NULL);
+	expect(s, IDENTIFIER, &name);
+	expect(s, LBRACKET, NULL);
+	expect(s, NUMBER, &size);
+	expect(s, RBRACKET, NULL);
+	if (peektype(s) == INC) {
+		expect(s, INC, NULL);
+		autoinc = true;
+	}
+	if (peektype(s) == ASSIGN) {
+		expect(s, ASSIGN, NULL);
+		expect(s, IDENTIFIER, NULL); /* file */
+		expect(s, STRING, &path);
+	}
+	expect(s, SEMICOLON, NULL);
+
+	printf("Memory %s[%zu]%s", name.lit, parse_size(&size, MEMORY_MAX),
+		autoinc ? " auto-increment" : "");
+	if (path.type == STRING)
+		printf(" = file \"%s\"", path.lit);
+	printf("\n");
+}
+
+/* Report a broadcast or merge node */
+static void
+report_route(Scanner *s, TokenType type)
+{
+	Token name;
+	Token count;
+
+	expect(s, type, NULL);
+	expect(s, IDENTIFIER, &name);
+	expect(s, LBRACKET, NULL);
+	expect(s, NUMBER, &count);
+	expect(s, RBRACKET, NULL);
+	expect(s, SEMICOLON, NULL);
+
+	printf("%s %s[%zu]\n", type == BROADCAST ? "Broadcast" : "Merge",
+		name.lit, parse_size(&count, ROUTE_MAX));
+}
+
+/* Report an input, output, or fd node */
+static void
+report_stream(Scanner *s, TokenType type)
+{
+	Token name;
+	Token value;
+
+	expect(s, type, NULL);
+	expect(s, IDENTIFIER, &name);
+	expect(s, ASSIGN, NULL);
+	expect(s, type == FD ? NUMBER : STRING, &value);
+	expect(s, SEMICOLON, NULL);
+
+	switch (type) {
+	case INPUT:  printf("Input %s = \"%s\"\n", name.lit, value.lit); break;
+	case OUTPUT: printf("Output %s = \"%s\"\n", name.lit, value.lit); break;
+	default:     printf("Fd %s = %s\n", name.lit, value.lit); break;
+	}
+}
+
+static void
+report_queue(Scanner *s)
+{
+	Token name;
+	Token capacity;
+
+	expect(s, QUEUE, NULL);
+	expect(s, IDENTIFIER, &name);
+	if (peektype(s) != LBRACKET) {
+		expect(s, SEMICOLON, NULL);
+		printf("Queue %s\n", name.lit);
+		return;
+	}
+
+	expect(s, LBRACKET, NULL);
+	expect(s, NUMBER, &capacity);
+	expect(s, RBRACKET, NULL);
+	expect(s, SEMICOLON, NULL);
+
+	printf("Queue %s[%zu]\n", name.lit, parse_size(&capacity, QUEUE_MAX));
+}
+
 static void
 report_wire(Scanner *s)
 {
@@ -122,22 +396,45 @@ report_wire(Scanner *s)
 		srcnode.lit, srcport.lit, destnode.lit, destport.lit);
 }
 
+static void
+usage(const char *argv0)
+{
+	errx(1, "usage: %s [--cache-dir dir] [--opstats file] [--time-phases] file",
+		argv0);
+}
+
 int
 main(int argc, char *argv[])
 {
-	SymDict dict = {0};
+	Arena arena = {0};
+	SymDict dict = {.arena = &arena};
 	Scanner s;
-	char *fname;
+	char *fname = NULL;
+	bool time_phases = false;
 	FILE *f;
 
-	if (argc != 2)
-		errx(1, "usage: %s file", argv[0]);
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--cache-dir") == 0) {
+			if (++i == argc) usage(argv[0]);
+			init_cache(argv[i]);
+		} else if (strcmp(argv[i], "--opstats") == 0) {
+			if (++i == argc) usage(argv[0]);
+			load_opstats(argv[i]);
+		} else if (strcmp(argv[i], "--time-phases") == 0) {
+			time_phases = true;
+		} else if (argv[i][0] == '-' || fname) {
+			usage(argv[0]);
+		} else {
+			fname = argv[i];
+		}
+	}
+	if (!fname) usage(argv[0]);
 
-	fname = argv[1];
 	f = fopen(fname, "r");
 	if (f == NULL)
-		err(1, "%s", argv[1]);
+		err(1, "%s", fname);
 
+	enter_phase(PHASE_SCAN);
 	init_error(f, fname);
 	init_scanner(&s, f);
 	while (peektype(&s) != TOK_EOF) {
@@ -151,6 +448,21 @@ main(int argc, char *argv[])
 		case STACK:
 			report_stack(&s);
 			break;
+		case MEMORY:
+			report_memory(&s);
+			break;
+		case BROADCAST:
+		case MERGE:
+			report_route(&s, peektype(&s));
+			break;
+		case INPUT:
+		case OUTPUT:
+		case FD:
+			report_stream(&s, peektype(&s));
+			break;
+		case QUEUE:
+			report_queue(&s);
+			break;
 		case IDENTIFIER:
 			report_wire(&s);
 			break;
@@ -161,6 +473,15 @@ main(int argc, char *argv[])
 		}
 	}
 
+	if (!has_errors() && Opstats.loaded)
+		report_opstats();
+	enter_phase(PHASE_OTHER);
+	if (!has_errors() && time_phases) {
+		write_phases(stdout);
+		printf("Peak arena usage: %zu bytes\n", arena_peak());
+	}
+
+	arena_release(&arena);
 	fclose(f);
 	return has_errors() ? 1 : 0;
 }
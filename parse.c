@@ -29,6 +29,28 @@ parse_int(const Token *tok)
 	return (uint8_t) val;
 }
 
+/* Parse a cstring into a size between 1 and max. Mark an error on
+ * boundary issues and invalid literals. */
+size_t
+parse_size(const Token *tok, size_t max)
+{
+	char *endptr;
+	unsigned long val = strtoul(tok->lit, &endptr, 0);
+
+	if (*endptr != '\0') {
+		send_error(&tok->pos, ERR, "Invalid integer");
+		return 0;
+	}
+
+	if (val == 0 || val > max) {
+		send_error(&tok->pos, ERR,
+			"Out of bounds error (must be 1 to %zu)", max);
+		return 0;
+	}
+
+	return (size_t) val;
+}
+
 /* Convert an escape sequence into a byte. Write the number of chars
  * to advance into *advance, and whether the parse is successful into
  * *ok. */
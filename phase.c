@@ -0,0 +1,83 @@
+/*
+ * phase - wall time and allocations per phase of a program load
+ *
+ * The phases interleave: noded compiles each processor body in the
+ * middle of scanning, and adds each node to the VM as it's declared.
+ * So rather than timing phases from start to end, each enter_phase()
+ * charges the time since the last one to the phase it leaves, and
+ * tags allocations with the phase it enters. A caller that steps into
+ * another phase briefly goes back with enter_phase(previous).
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <time.h>
+
+#include "noded.h"
+
+static const char *const phase_names[NUM_PHASES] = {
+	[PHASE_OTHER]   = "other",
+	[PHASE_PRESCAN] = "prescan",
+	[PHASE_SCAN]    = "scan",
+	[PHASE_COMPILE] = "compile",
+	[PHASE_WIRE]    = "wire",
+	[PHASE_VM]      = "vm init",
+	[PHASE_RUN]     = "run",
+};
+
+/* Module-global variables */
+static struct {
+	Phase cur;
+	uint64_t since; /* when cur was entered, or 0 before the first */
+	uint64_t ns[NUM_PHASES];
+} Phases = {0};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Leave the current phase for phase, and return the one left */
+Phase
+enter_phase(Phase phase)
+{
+	Phase prev = Phases.cur;
+	uint64_t now = now_ns();
+
+	if (Phases.since) Phases.ns[prev] += now - Phases.since;
+	Phases.since = now;
+	Phases.cur = phase;
+	alloc_tag(phase);
+	return prev;
+}
+
+/* Print a table of each phase's time and allocations to f, skipping
+ * phases that never came up, and time outside the phases unless it
+ * allocated. The current phase is charged up to now. */
+void
+write_phases(FILE *f)
+{
+	uint64_t allocs, bytes, total_ns = 0, total_allocs = 0, total_bytes = 0;
+
+	enter_phase(Phases.cur);
+	fprintf(f, "\n%-10s %12s %12s %14s\n", "phase", "time(ms)", "allocs",
+		"bytes");
+	for (int i = 0; i < NUM_PHASES; i++) {
+		alloc_counts((Phase) i, &allocs, &bytes);
+		if (!allocs && (i == PHASE_OTHER || !Phases.ns[i])) continue;
+
+		fprintf(f, "%-10s %12.3f %12llu %14llu\n", phase_names[i],
+			(double) Phases.ns[i] / 1e6, (unsigned long long) allocs,
+			(unsigned long long) bytes);
+		total_ns += Phases.ns[i];
+		total_allocs += allocs;
+		total_bytes += bytes;
+	}
+	fprintf(f, "%-10s %12.3f %12llu %14llu\n", "total",
+		(double) total_ns / 1e6, (unsigned long long) total_allocs,
+		(unsigned long long) total_bytes);
+}
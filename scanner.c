@@ -42,6 +42,8 @@ static TokenRule token_table[UCHAR_MAX+1] = {
 	[')'] =  {&simple,  RPAREN, 0, 0, 0, 0},
 	['{'] =  {&simple,  LBRACE, 0, 0, 0, 0},
 	['}'] =  {&simple,  RBRACE, 0, 0, 0, 0},
+	['['] =  {&simple,  LBRACKET, 0, 0, 0, 0},
+	[']'] =  {&simple,  RBRACKET, 0, 0, 0, 0},
 	[':'] =  {&simple,  COLON, 0, 0, 0, 0},
 	[','] =  {&simple,  COMMA, 0, 0, 0, 0},
 	['.'] =  {&simple,  PERIOD, 0, 0, 0, 0},
@@ -91,15 +93,21 @@ isident(char c)
 static void
 next(Scanner *s)
 {
-	/* Update linenumber based on current character. */
+	int c;
+
+	/* Update linenumber based on current character, and record
+	 * where each new line starts for error reporting. */
 	if (s->chr == '\n') {
 		s->pos.lineno++;
 		s->pos.colno = 0;
+		index_line(s->pos.lineno, s->offset);
 	} else {
 		s->pos.colno++;
 	}
 
-	s->chr = getc(s->f);
+	c = getc(s->f);
+	if (c != EOF) s->offset++;
+	s->chr = c;
 }
 
 void
@@ -108,6 +116,8 @@ init_scanner(Scanner *scanner, FILE *f)
 	memset(scanner, 0, sizeof(*scanner));
 	scanner->f = f;
 	scanner->pos.lineno = 1;
+	scanner->offset = ftell(f);
+	index_line(1, scanner->offset);
 
 	/* TODO: skip the UTF-8 optional BOM */
 
@@ -541,14 +551,56 @@ expect(Scanner *s, TokenType expected, Token *dest)
 	} else {
 		send_error(&tok.pos, ERR, "Expected %s, but received %s",
 			tokstr(expected), tokstr(tok.type));
+
+		/* Leave the caller a token to report further errors at */
+		if (dest) *dest = tok;
 		return;
 	}
 }
 
-/* Keep scanning tokens until the next token type is target. */
+/* Keep scanning tokens until the next token type is target, or the
+ * end of the file. */
 void
 zap_to(Scanner *s, TokenType target)
 {
-	while (target != peektype(s))
+	while (target != peektype(s) && TOK_EOF != peektype(s))
 		scan(s, NULL);
-}
\ No newline at end of file
+}
+
+/* Record the scanner's state so that it can rewind back to it with
+ * reset_scanner(). The underlying file must be seekable. The mark is
+ * allocated, and the caller frees it. */
+ScanMark *
+mark_scanner(const Scanner *s)
+{
+	size_t len = s->buffered ? strlen(s->peek.lit) : 0;
+	ScanMark *mark = ecalloc(1, sizeof(*mark) + len + 1);
+
+	mark->chr = s->chr;
+	mark->pos = s->pos;
+	mark->offset = s->offset;
+	mark->buffered = s->buffered;
+	if (s->buffered) {
+		mark->type = s->peek.type;
+		mark->peekpos = s->peek.pos;
+		memcpy(mark->lit, s->peek.lit, len + 1);
+	}
+	return mark;
+}
+
+/* Rewind the scanner to a state recorded by mark_scanner() */
+void
+reset_scanner(Scanner *s, const ScanMark *mark)
+{
+	s->chr = mark->chr;
+	s->pos = mark->pos;
+	s->offset = mark->offset;
+	s->buffered = mark->buffered;
+	if (mark->buffered) {
+		s->peek.type = mark->type;
+		s->peek.pos = mark->peekpos;
+		strcpy(s->peek.lit, mark->lit);
+	}
+	if (fseek(s->f, mark->offset, SEEK_SET) < 0)
+		send_error(&s->pos, FATAL, "cannot rewind source file");
+}
@@ -0,0 +1,184 @@
+/*
+ * stats - report the running VM's counters while it runs
+ *
+ * SIGUSR1 writes the counters to stderr, and with --stats-file, a
+ * timer rewrites the file every few seconds. Both happen in signal
+ * handlers, in the middle of whatever the VM was doing, so everything
+ * here sticks to async-signal-safe calls: no stdio and no allocation.
+ * The file is written next to its final name and renamed over it, so a
+ * reader never sees half of it.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "noded.h"
+
+enum { STATS_PATH_MAX = 4096 };
+
+/* Module-global variables */
+static struct {
+	const char *path; /* stats file, or NULL */
+	char tmp[STATS_PATH_MAX]; /* where it's written before the rename */
+	struct timespec start;
+	timer_t timer;
+} Stats = {0};
+
+/* Append the decimal digits of n to buf at *len */
+static void
+put_uint(char *buf, size_t *len, uint64_t n)
+{
+	char digits[20];
+	int i = 0;
+
+	do {
+		digits[i++] = (char) ('0' + n % 10);
+		n /= 10;
+	} while (n);
+	while (i > 0)
+		buf[(*len)++] = digits[--i];
+}
+
+/* Append a `key value` line to buf at *len */
+static void
+put_stat(char *buf, size_t *len, const char *key, uint64_t n)
+{
+	size_t keylen = strlen(key);
+
+	memcpy(buf + *len, key, keylen);
+	*len += keylen;
+	buf[(*len)++] = ' ';
+	put_uint(buf, len, n);
+	buf[(*len)++] = '\n';
+}
+
+/* Write the VM's counters to fd, one `key value` line each */
+void
+write_stats(int fd)
+{
+	char buf[512];
+	size_t len = 0;
+	ssize_t n;
+	struct timespec now;
+	VMStats st;
+
+	vm_stats(&st);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	put_stat(buf, &len, "elapsed_ms",
+		(uint64_t) (now.tv_sec - Stats.start.tv_sec) * 1000
+		+ (uint64_t) (now.tv_nsec / 1000000)
+		- (uint64_t) (Stats.start.tv_nsec / 1000000));
+	put_stat(buf, &len, "ticks", st.ticks);
+	put_stat(buf, &len, "messages", st.messages);
+	put_stat(buf, &len, "io_bytes_in", st.bytes_in);
+	put_stat(buf, &len, "io_bytes_out", st.bytes_out);
+	put_stat(buf, &len, "runnable", st.runnable);
+	put_stat(buf, &len, "blocked", st.blocked);
+	put_stat(buf, &len, "halted", st.halted);
+	put_stat(buf, &len, "stack_bytes", st.stack_bytes);
+	put_stat(buf, &len, "stack_spilled_bytes", st.spilled_bytes);
+
+	for (size_t off = 0; off < len; off += (size_t) n) {
+		n = write(fd, buf + off, len - off);
+		if (n < 0 && errno == EINTR) n = 0;
+		else if (n <= 0) return;
+	}
+}
+
+/* Rewrite the stats file. Errors are dropped, since there's nowhere
+ * safe to report them from a handler; the next write tries again. */
+static void
+write_stats_file(void)
+{
+	int fd = open(Stats.tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0) return;
+	write_stats(fd);
+	close(fd);
+	rename(Stats.tmp, Stats.path);
+}
+
+static void
+on_dump(int sig)
+{
+	int saved = errno;
+	(void)sig;
+
+	write_stats(STDERR_FILENO);
+	errno = saved;
+}
+
+static void
+on_timer(int sig)
+{
+	int saved = errno;
+	(void)sig;
+
+	write_stats_file();
+	errno = saved;
+}
+
+/*
+ * Dump the counters to stderr on SIGUSR1 from now on, and if path
+ * isn't NULL, write them to path every interval seconds, and once more
+ * when stop_stats() is called.
+ */
+void
+start_stats(const char *path, unsigned interval)
+{
+	struct sigaction sa = {0};
+	struct sigevent sev = {0};
+	struct itimerspec its = {0};
+
+	clock_gettime(CLOCK_MONOTONIC, &Stats.start);
+
+	sa.sa_handler = &on_dump;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaddset(&sa.sa_mask, SIGALRM);
+	if (sigaction(SIGUSR1, &sa, NULL) < 0)
+		err(1, "sigaction");
+
+	if (!path) return;
+	if ((size_t) snprintf(Stats.tmp, sizeof(Stats.tmp), "%s.tmp", path)
+			>= sizeof(Stats.tmp))
+		errx(1, "%s: path too long", path);
+	Stats.path = path;
+	write_stats_file();
+
+	sa.sa_handler = &on_timer;
+	sigemptyset(&sa.sa_mask);
+	sigaddset(&sa.sa_mask, SIGUSR1);
+	if (sigaction(SIGALRM, &sa, NULL) < 0)
+		err(1, "sigaction");
+
+	sev.sigev_notify = SIGEV_SIGNAL;
+	sev.sigev_signo = SIGALRM;
+	if (timer_create(CLOCK_MONOTONIC, &sev, &Stats.timer) < 0)
+		err(1, "timer_create");
+
+	its.it_interval.tv_sec = interval;
+	its.it_value = its.it_interval;
+	if (timer_settime(Stats.timer, 0, &its, NULL) < 0)
+		err(1, "timer_settime");
+}
+
+/* Stop the timer and write the stats file a last time */
+void
+stop_stats(void)
+{
+	struct itimerspec its = {0};
+
+	if (!Stats.path) return;
+	timer_settime(Stats.timer, 0, &its, NULL);
+	signal(SIGALRM, SIG_IGN);
+	write_stats_file();
+}
@@ -0,0 +1,143 @@
+#!/bin/sh
+#
+# check.sh - run the golden-output and performance-regression tests
+#
+#   sh tests/check.sh [TOLERANCE]
+#   sh tests/check.sh --baseline
+#
+# Run from the top of the tree after `make noded noded-prof`, which
+# `make check` does. Every tests/golden/NAME.in is a test case: it's
+# fed to tests/NAME.nod, or examples/NAME.nod if there's no such test
+# program, and the program's stdout must match NAME.out and its stderr
+# NAME.err (or be empty, without one). A NAME may carry a suffix after
+# an @, as in pass@ok, to give one program several cases.
+#
+# NAME.flags, if there is one, holds options for noded, which go before
+# the program. The shell reads them, so they may also redirect, as in
+# 3>&1, and use $tmp, a scratch directory for the case. A case with
+# flags runs twice, so that the second run uses whatever the first left
+# in $tmp, like a cache. NAME.status holds the exit status expected, if
+# it isn't 0.
+#
+# Each case's instruction and run() sweep counts, taken from the
+# profiling build noded-prof, are compared against tests/baseline.txt.
+# They are deterministic, so a count more than TOLERANCE percent (5
+# by default) over its baseline fails the case, even on a noisy
+# machine. --baseline rewrites tests/baseline.txt from the current
+# counts instead.
+
+baseline=tests/baseline.txt
+tolerance=5
+update=false
+
+case $1 in
+--baseline) update=true ;;
+?*) tolerance=$1 ;;
+esac
+
+work=${TMPDIR:-/tmp}/noded-check.$$
+mkdir -p "$work"
+trap 'rm -rf "$work"' EXIT INT TERM
+
+# Don't let a program that never stops hang the whole run
+limit=
+command -v timeout >/dev/null 2>&1 && limit="timeout 10"
+
+passed=0 failed=0
+
+fail() {
+	echo "FAIL $name: $1"
+	failed=$((failed + 1))
+	ok=false
+}
+
+if $update; then
+	echo "# case instructions sweeps" >"$work/baseline"
+fi
+
+for input in tests/golden/*.in; do
+	name=$(basename "$input" .in)
+	prog=${name%%@*}
+	golden=tests/golden/$name
+	ok=true
+
+	if [ -f "tests/$prog.nod" ]; then
+		prog=tests/$prog.nod
+	else
+		prog=examples/$prog.nod
+	fi
+
+	flags=
+	[ -f "$golden.flags" ] && flags=$(cat "$golden.flags")
+	status=0
+	[ -f "$golden.status" ] && status=$(cat "$golden.status")
+	tmp=$work/$name
+	mkdir -p "$tmp"
+	runs=1
+	[ -n "$flags" ] && runs="1 2"
+	experr=/dev/null
+	[ -f "$golden.err" ] && experr=$golden.err
+
+	# Golden output
+	for run in $runs; do
+		at=
+		[ -n "$flags" ] && at="run $run: "
+		eval "$limit ./noded $flags \"\$prog\"" \
+			<"$input" >"$work/out" 2>"$work/err"
+		got=$?
+		[ "$got" -eq "$status" ] || fail "${at}exited with status $got"
+		if ! cmp -s "$work/out" "$golden.out"; then
+			fail "${at}stdout differs from $golden.out"
+			diff "$golden.out" "$work/out" | head -10
+		fi
+		if ! cmp -s "$work/err" "$experr"; then
+			fail "${at}stderr differs from $experr"
+			diff "$experr" "$work/err" | head -10
+		fi
+	done
+
+	# Instruction and sweep counts
+	eval "$limit ./noded-prof --profile \"\$work/prof\" $flags \"\$prog\"" \
+		<"$input" >/dev/null 2>&1
+	counts=$(awk '
+		/"sweeps"/ { sub(/.*"sweeps": /, ""); sweeps = $0 + 0 }
+		/"instructions"/ { sub(/.*"instructions": /, ""); instrs += $0 + 0 }
+		END { print instrs + 0, sweeps + 0 }' "$work/prof")
+
+	if $update; then
+		echo "$name $counts" >>"$work/baseline"
+	else
+		expected=$(awk -v name="$name" '$1 == name { print $2, $3 }' "$baseline")
+		if [ -z "$expected" ]; then
+			fail "no baseline (run make check-baseline)"
+		else
+			verdict=$(echo "$counts $expected" | awk -v tol="$tolerance" '
+				function check(what, n, base) {
+					if (n > base * (1 + tol/100))
+						printf "%s %s regressed from %d to %d\n", "fail", what, base, n
+					else if (n < base * (1 - tol/100))
+						printf "%s %s improved from %d to %d\n", "note", what, base, n
+				}
+				{ check("instructions", $1, $3); check("sweeps", $2, $4) }')
+			echo "$verdict" | while read -r kind rest; do
+				[ "$kind" = note ] &&
+					echo "note $name: $rest (run make check-baseline)"
+			done
+			regressed=$(echo "$verdict" | sed -n 's/^fail //p' | head -1)
+			[ -n "$regressed" ] && fail "$regressed"
+		fi
+	fi
+
+	if $ok; then
+		echo "ok   $name"
+		passed=$((passed + 1))
+	fi
+done
+
+if $update; then
+	mv "$work/baseline" "$baseline"
+	echo "wrote $baseline"
+fi
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]
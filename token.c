@@ -20,6 +20,8 @@ static const char *tokens[] = {
 	[RPAREN] = ")",
 	[LBRACE] = "{",
 	[RBRACE] = "}",
+	[LBRACKET] = "[",
+	[RBRACKET] = "]",
 
 	[COLON] = ":",
 	[COMMA] = ",",
@@ -93,8 +95,15 @@ static const char *tokens[] = {
 	[IF] = "if",
 	[WHILE] = "while",
 
+	[BROADCAST] = "broadcast",
 	[BUFFER] = "buffer",
+	[FD] = "fd",
+	[INPUT] = "input",
+	[MEMORY] = "memory",
+	[MERGE] = "merge",
+	[OUTPUT] = "output",
 	[PROCESSOR] = "processor",
+	[QUEUE] = "queue",
 	[STACK] = "stack",
 };
 
@@ -113,8 +122,15 @@ struct {
 	{"halt", HALT},
 	{"if", IF},
 	{"while", WHILE},
+	{"broadcast", BROADCAST},
 	{"buffer", BUFFER},
+	{"fd", FD},
+	{"input", INPUT},
+	{"memory", MEMORY},
+	{"merge", MERGE},
+	{"output", OUTPUT},
 	{"processor", PROCESSOR},
+	{"queue", QUEUE},
 	{"stack", STACK},
 	{NULL, ILLEGAL}
 };
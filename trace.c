@@ -0,0 +1,171 @@
+/*
+ * trace - Chrome trace-event output
+ *
+ * A busy pipeline moves a value on every few instructions, far more
+ * events than could be formatted as they happen. Events are instead
+ * kept as plain records in a ring holding the last TRACE_EVENTS of
+ * them, and formatted only when the trace is closed, so recording an
+ * event costs a few stores and a long run keeps its most recent
+ * stretch. The output is a JSON array of trace events, which loads
+ * into chrome://tracing and Perfetto. Each track is a tid under pid 1,
+ * and timestamps are microseconds since the trace was opened.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "noded.h"
+
+enum
+{
+	/* The most events kept. It must be a power of two. */
+	TRACE_EVENTS = 1<<19,
+};
+
+typedef struct TraceEvent TraceEvent;
+struct TraceEvent {
+	char ph; /* the trace-event phase: X, s or f */
+	uint32_t tid;
+	const char *name;
+	uint64_t ts;  /* nanoseconds */
+	uint64_t arg; /* the duration for X, the flow id for s and f */
+};
+
+/* Module-global variables */
+static struct {
+	FILE *f;
+	TraceEvent *ring;
+	size_t head;      /* where the next event goes */
+	uint64_t dropped; /* events overwritten */
+	uint64_t epoch;
+} Trace = {0};
+
+uint64_t
+trace_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+/* Print nanoseconds since the epoch as microseconds */
+static void
+write_us(uint64_t ns)
+{
+	fprintf(Trace.f, "%llu.%03u", (unsigned long long) (ns / 1000),
+		(unsigned) (ns % 1000));
+}
+
+static void
+write_event(const TraceEvent *ev)
+{
+	const char *name = ev->name ? ev->name : "?";
+
+	fprintf(Trace.f, ",\n{\"ph\":\"%c\",\"pid\":1,\"tid\":%lu,"
+		"\"name\":\"%s\",", ev->ph, (unsigned long) ev->tid, name);
+
+	if (ev->ph == 'X') {
+		fprintf(Trace.f, "\"dur\":");
+		write_us(ev->arg);
+		fprintf(Trace.f, ",");
+	} else {
+		fprintf(Trace.f, "\"cat\":\"wire\",\"id\":%llu,",
+			(unsigned long long) ev->arg);
+		if (ev->ph == 'f') fprintf(Trace.f, "\"bp\":\"e\",");
+	}
+
+	fprintf(Trace.f, "\"ts\":");
+	write_us(ev->ts);
+	fprintf(Trace.f, "}");
+}
+
+static TraceEvent *
+new_event(char ph, uint32_t tid, const char *name)
+{
+	TraceEvent *ev = &Trace.ring[Trace.head];
+
+	if (ev->ph) Trace.dropped++;
+	Trace.head = (Trace.head + 1) & (TRACE_EVENTS - 1);
+	ev->ph = ph;
+	ev->tid = tid;
+	ev->name = name;
+	return ev;
+}
+
+/* Start a trace written to f. The trace is closed at exit if
+ * trace_close() hasn't been called, so that a run stopped by a runtime
+ * error still leaves a usable file. */
+void
+trace_open(FILE *f)
+{
+	Trace.f = f;
+	Trace.ring = ecalloc(TRACE_EVENTS, sizeof(*Trace.ring));
+	Trace.head = 0;
+	Trace.dropped = 0;
+	Trace.epoch = trace_clock();
+
+	/* Every event after this one starts with a comma */
+	fprintf(f, "[{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\","
+		"\"args\":{\"name\":\"noded\"}}");
+	atexit(&trace_close);
+}
+
+/* Name a track. Names are written right away, so that they are never
+ * dropped from the ring. */
+void
+trace_thread(uint32_t tid, const char *name)
+{
+	fprintf(Trace.f, ",\n{\"ph\":\"M\",\"pid\":1,\"tid\":%lu,"
+		"\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}",
+		(unsigned long) tid, name ? name : "?");
+}
+
+/* Record a span on track tid from start to end, in trace_clock() time */
+void
+trace_span(uint32_t tid, const char *name, uint64_t start, uint64_t end)
+{
+	TraceEvent *ev = new_event('X', tid, name);
+
+	ev->ts = start - Trace.epoch;
+	ev->arg = end - start;
+}
+
+/* Record one end of flow id, which binds to the span around ts on
+ * track tid. */
+void
+trace_flow(uint32_t tid, const char *name, uint64_t id, bool start, uint64_t ts)
+{
+	TraceEvent *ev = new_event(start ? 's' : 'f', tid, name);
+
+	ev->arg = id;
+	ev->ts = ts - Trace.epoch;
+}
+
+/* Write out the events in the ring, oldest first, and end the trace */
+void
+trace_close(void)
+{
+	size_t i = Trace.head;
+
+	if (!Trace.f) return;
+
+	do {
+		if (Trace.ring[i].ph) write_event(&Trace.ring[i]);
+		i = (i + 1) & (TRACE_EVENTS - 1);
+	} while (i != Trace.head);
+	fprintf(Trace.f, "\n]\n");
+	fflush(Trace.f);
+
+	if (Trace.dropped) {
+		fprintf(stderr, "warning: trace kept only the last %d events "
+			"(%llu dropped).\n", TRACE_EVENTS,
+			(unsigned long long) Trace.dropped);
+	}
+
+	free(Trace.ring);
+	Trace.ring = NULL;
+	Trace.f = NULL;
+}
@@ -13,16 +13,25 @@ enum
 	VEC_START = 8,
 };
 
+/* Resize a vector's buffer from its arena, or from the heap */
+static void *
+grow(Arena *arena, void *buf, size_t oldsize, size_t size)
+{
+	if (arena) return arena_realloc(arena, buf, oldsize, size);
+	return erealloc(buf, size);
+}
+
 /* add val to the end of vec */
 void
 bytevec_append(ByteVec *vec, uint8_t val)
 {
 	if (vec->len == vec->cap) {
+		size_t oldcap = vec->cap;
 		vec->cap = vec->cap ? vec->cap*2 : VEC_START;
-		vec->buf = erealloc(vec->buf, vec->cap);
+		vec->buf = grow(vec->arena, vec->buf, oldcap, vec->cap);
 	}
 
-	vec->buf[vec->len++] = val;	
+	vec->buf[vec->len++] = val;
 }
 
 /* reserve nmemb members in vec and return the reserved memory's index */
@@ -32,9 +41,10 @@ bytevec_reserve(ByteVec *vec, size_t nmemb)
 	size_t result;
 
 	if (vec->len + nmemb >= vec->cap) {
+		size_t oldcap = vec->cap;
 		vec->cap = vec->cap ? MAX(vec->cap*2, vec->cap+nmemb)
 							: MAX(VEC_START, nmemb);
-		vec->buf = erealloc(vec->buf, vec->cap);
+		vec->buf = grow(vec->arena, vec->buf, oldcap, vec->cap);
 	}
 
 	result = vec->len;
@@ -46,7 +56,7 @@ bytevec_reserve(ByteVec *vec, size_t nmemb)
 void
 bytevec_shrink(ByteVec *vec)
 {
-	if (vec->len == vec->cap) return;
+	if (vec->len == vec->cap || vec->arena) return;
 	vec->cap = vec->len;
 	vec->buf = erealloc(vec->buf, vec->cap);
 }
@@ -56,17 +66,22 @@ void
 addrvec_append(AddrVec *vec, uint16_t val)
 {
 	if (vec->len == vec->cap) {
+		size_t oldcap = vec->cap;
 		vec->cap = vec->cap ? vec->cap*2 : VEC_START;
-		vec->buf = erealloc(vec->buf, vec->cap*sizeof(*vec->buf));
+		vec->buf = grow(vec->arena, vec->buf,
+			oldcap*sizeof(*vec->buf), vec->cap*sizeof(*vec->buf));
 	}
 
 	vec->buf[vec->len++] = val;
 }
 
-/* Free the buffer and set the vec to its zero value */
+/* Free the buffer and set the vec to its zero value, keeping its arena */
 void
 addrvec_clear(AddrVec *vec)
 {
-	free(vec->buf);
+	Arena *arena = vec->arena;
+
+	if (!arena) free(vec->buf);
 	memset(vec, 0, sizeof(*vec));
-}
\ No newline at end of file
+	vec->arena = arena;
+}
@@ -1,64 +1,332 @@
 /*
  * vm - virtual machine execution
  */
+#define _POSIX_C_SOURCE 200809L
+
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "noded.h"
 
 enum
 {
-	STACK_SIZE = 512,
+	/* Stack nodes store their data in chunks of this many bytes */
+	STACK_CHUNK = 1<<14,
+
+	/* The most free chunks the pool keeps around for reuse */
+	POOL_MAX = 64,
+
+	/* The size of each file node's read and write buffers */
+	FILE_BUF = 4096,
+};
+
+#ifdef PROFILE
+/*
+ * Profiling counters, compiled in with -DPROFILE (make PROFILE=1).
+ * Every count is kept per processor or per wire, and times are in
+ * nanoseconds on the monotonic clock.
+ */
+typedef struct ProcStats ProcStats;
+struct ProcStats {
+	uint64_t instrs;
+	uint64_t sends, send_fails;
+	uint64_t recvs, recv_fails;
+	uint64_t runs;    /* sweeps where the processor made progress */
+	uint64_t blocked; /* sweeps where it was stuck, but not halted */
+	uint64_t halt_ns; /* when it first halted, or 0 */
+};
+
+/* Each side of a wire is stalled from its first failed attempt to move
+ * a message until the attempt succeeds. */
+typedef struct WireStats WireStats;
+struct WireStats {
+	uint64_t messages;
+	uint64_t send_stalls, recv_stalls; /* failed attempts */
+	uint64_t send_ns, recv_ns;         /* total time stalled */
+	uint64_t send_since, recv_since;   /* start of the current stall */
+};
+
+struct Profile {
+	ProcStats *procs; /* parallel to vm->procs */
+	WireStats *wires;
+	uint64_t sweeps;
+	uint64_t waits; /* times run() waited on file nodes */
+	uint64_t start_ns, end_ns;
+};
+#endif
+
+#ifdef OPSTATS
+/*
+ * Dispatch counters, compiled in with -DOPSTATS (make OPSTATS=1).
+ * pairs[a][b] counts op b being dispatched right after op a by the same
+ * processor run, and addrs holds each processor's count per address.
+ */
+struct OpStats {
+	uint64_t ops[NUM_OPCODES];
+	uint64_t pairs[NUM_OPCODES][NUM_OPCODES];
+	uint64_t **addrs; /* parallel to vm->procs */
 };
+#endif
 
 /* Holds all metadata for sending and receiving data */
 typedef struct Port Port;
 struct Port {
-	Node *recp; /* owned by VM */
+	void *recp; /* owned by VM; NULL for the IO node */
+	NodeType type;
 	int recp_port;
 
 	Wire *wire; /* owned by VM */
+
+#ifdef PROFILE
+	WireStats *stats;
+#endif
 };
 
 /* Processor nodes execute code and send/receive messages
- * between other nodes. */
-typedef struct ProcNode ProcNode;
+ * between other nodes. Only the state that tick() touches lives
+ * here, so that a sweep over vm->procs stays within a cache line
+ * per processor. */
 struct ProcNode {
-	const uint8_t *code;
 	const uint8_t *isp; /* isp = &code[i] */
+	uint8_t *sp; /* sp = &stack[i] */
+
+	const uint8_t *code;
 	const uint8_t *code_end; /* code_end = &code[size] */
 
-	Port ports[PORT_MAX];
-	uint8_t vars[VAR_MAX];
-
-	/* I think I'll keep the stack statically allocated. It's
-	 * large enough to prevent most stack overflows, it's close
-	 * enough to related memory to reduce cache misses, and
-	 * stack overflows when nodes are otherwise quite constrained
-	 * are more likely a bug in the compiler that I can identify
-	 * earlier with a stack overflow error than a program pushing
-     * values forever. */
-	uint8_t stack[STACK_SIZE];
-	uint8_t *sp; /* sp = &stack[i] */
+	/* The stack is sized to the deepest its code can go, as found
+	 * by code_depth(), so an overflow here is a bug in the compiler
+	 * rather than a program pushing values forever. The stack itself
+	 * lives in vm->stackmem, away from the hot state, and the
+	 * processor's private arrays directly follow it at stack_end.
+	 * Variables past the first SHORT_SLOTS sit just below the
+	 * stack, growing downward from stack[-1]. */
+	uint8_t *stack;
+	uint8_t *stack_end;
+
+	Port *ports; /* in vm->portmem */
+	uint8_t vars[SHORT_SLOTS];
+};
+
+/* If a processor's code is NULL, load() fills it in before its first
+ * tick. nvars, depth and arrsize size the processor's slab of
+ * stackmem, and are known up front for processors that aren't loaded
+ * lazily. */
+typedef enum
+{
+	PROC_RUNNABLE, /* the zero value, for processors not run yet */
+	PROC_BLOCKED,
+	PROC_HALTED,
+} ProcState;
+
+struct ProcLoader {
+	CodeLoader load;
+	void *dat;
+	int wait_port; /* see add_lazy_proc_node() */
+	uint8_t state; /* ProcState, as the live counters last counted it */
+	uint16_t depth;
+	uint16_t arrsize;
+	uint16_t nvars;
+	uint16_t nports;
+
+	/* The line table, for reports */
+	const uint8_t *lines;
+	uint32_t linesize;
+	int line;
+};
+
+/* Before linking, a port records the recipient and wire by index. */
+struct PortDecl {
+	bool wired;
+	size_t node;
+	int recp_port;
+	size_t wire;
 };
 
 /* Buffer nodes store and recall data for processor nodes to use. */
-typedef struct BufNode BufNode;
 struct BufNode {
 	uint8_t idx;
-	uint8_t data[BUFFER_NODE_MAX];
+	uint8_t *data; /* BUFFER_NODE_MAX bytes */
+	bool mapped; /* data is from map_file()'s mmap(), not the heap */
+};
+
+/* A chunk of a stack node's data, or a free chunk in the pool */
+typedef struct Chunk Chunk;
+struct Chunk {
+	union {
+		Chunk *next; /* while in the pool's free list */
+		uint8_t data[STACK_CHUNK];
+	} u;
+};
+
+/* Chunks freed by draining stacks are kept here for the next stack
+ * that grows, rather than going back to malloc each time. */
+struct ChunkPool {
+	Chunk *free;
+	size_t nfree;
+
+	size_t limit; /* bytes each stack keeps in memory; 0 is no limit */
 };
 
-/* Stack nodes push and pop data. Similar to buffer nodes, except
+/*
+ * Stack nodes push and pop data. Similar to buffer nodes, except
  * they have a dynamically allocated amount of space to store, rather
- * than a fixed space constrained by the maximum value of the byte. */
-typedef struct StackNode StackNode;
+ * than a fixed space constrained by the maximum value of the byte.
+ *
+ * The data is stored in chunks, chunks[0] at the bottom. Once the
+ * resident chunks reach the pool's limit, the oldest are spilled to a
+ * temporary file at offset i*STACK_CHUNK and their slots set to NULL,
+ * so that chunks[nspilled..nchunks-1] are always the ones in memory.
+ * The file is truncated as chunks are read back, so it's only as long
+ * as the spilled chunks.
+ */
 struct StackNode {
-	/* Should I typedef the bytevec directly? */
-	ByteVec vec;
+	ChunkPool *pool;
+
+	Chunk **chunks;
+	size_t nchunks;
+	size_t chunkcap;
+	size_t nspilled;
+
+	size_t toplen; /* bytes used in the top chunk */
+
+	int fd; /* the spill file, or -1 */
+};
+
+/* Memory nodes are like buffer nodes with up to 64 KiB of storage,
+ * addressed by the two bytes %hi and %lo. With autoinc set, every
+ * access through %elm moves the address to the next element, so a
+ * sequential scan costs one message per byte. */
+struct MemNode {
+	uint8_t *data;
+	size_t size;
+	size_t addr;
+	bool autoinc;
+	bool mapped; /* as for BufNode */
+};
+
+/* Broadcast nodes copy each byte sent to %in to every wired output.
+ * A new byte is accepted only once every output has taken the last
+ * one, so the slowest reader sets the pace. */
+struct BroadcastNode {
+	uint8_t val;
+	uint32_t wired;   /* bit n is set if out<n> is wired */
+	uint32_t pending; /* bit n is set if out<n> hasn't taken val */
+};
+
+/* Merge nodes hold one byte per input, and pass them on to %out in
+ * round-robin order, so that no writer can starve the others. */
+struct MergeNode {
+	uint8_t vals[ROUTE_MAX];
+	uint32_t full; /* bit n is set if vals[n] holds a byte */
+	int next;      /* the input to check first */
+};
+
+/*
+ * File nodes read and write a file descriptor through their own
+ * buffers. The descriptor is non-blocking, so a node waiting on a slow
+ * pipe blocks only the processors using it; run() polls the waiting
+ * descriptors once nothing else can make progress.
+ */
+struct FileNode {
+	int fd;
+	int flags; /* fd's file status flags before it was made non-blocking */
+	bool readable, writable;
+
+	uint8_t rbuf[FILE_BUF];
+	size_t rpos, rlen;
+	bool eof;
+	bool rwait; /* a read is waiting for data */
+
+	uint8_t wbuf[FILE_BUF];
+	size_t wlen; /* bytes waiting to be written */
+	bool wwait; /* a write is waiting for room */
+};
+
+/* Queue nodes pass data along first-in, first-out. The data lives in
+ * a ring buffer whose size is a power of two, so that wrapping an index
+ * around is a mask instead of a division. An unbounded queue (capacity
+ * 0) doubles its ring when it fills up; a bounded one blocks senders
+ * instead. */
+struct QueueNode {
+	uint8_t *data;
+	size_t mask; /* ring size - 1 */
+	size_t head; /* index of the oldest element */
+	size_t len;
+	size_t capacity;
 };
 
+#if defined(PROFILE) || defined(OPSTATS)
+/* Module-global variables */
+static struct {
+#ifdef PROFILE
+	ProcStats *cur; /* the processor being run */
+#endif
+#ifdef OPSTATS
+	OpStats *opstats;
+	uint64_t *addrs; /* the running processor's address counts */
+	Opcode prev;     /* the last op dispatched, or NUM_OPCODES */
+#endif
+} Globals = {0};
+#endif
+
+/* The sampling profiler's state. The SIGPROF handler reads which
+ * processor is running, and counts a sample at its isp. */
+static struct {
+	const VM *vm;
+	volatile size_t cur; /* the processor being run, or SIZE_MAX */
+	uint32_t **counts;   /* per processor and address, once loaded */
+	volatile uint32_t other; /* samples outside any processor */
+	timer_t timer;
+} Sampler = {.cur = SIZE_MAX};
+
+/* The tracer's state. Each processor run is timed from the end of the
+ * one before it, so that a run costs a single clock read. A value put
+ * on a wire starts a flow that ends where it is received; flows[w] is
+ * the id of the last value put on wire w. */
+static struct {
+	const VM *vm;
+	bool on;
+	uint32_t tid;    /* the running processor's track */
+	uint64_t start;  /* when the current run or sweep began */
+	bool flowed;     /* whether the current run started a flow */
+	uint64_t *flows; /* per wire */
+	uint64_t nextflow;
+	const char **names; /* per processor */
+} Tracer = {0};
+
+/* The running VM's counters. They're plain fields rather than
+ * volatile, so that counting costs the hot paths next to nothing, and a
+ * signal handler reading them may see values a few instructions old.
+ * Ticks are added LIVE_TICKS at a time, so they lag further. */
+static VMStats Live = {0};
+
+/* The IO node's state. stdin is normally blocking, but it can be
+ * inherited non-blocking, and then a read may find nothing yet. */
+static struct {
+	bool rwait; /* a read from stdin would have blocked */
+} IO = {0};
+
+/* A descriptor's non-blocking flag belongs to the open file, which
+ * other processes may share, so file nodes' flags are put back when the
+ * VM is freed or the program exits. */
+static struct {
+	const VM *vm; /* whose file nodes to restore at exit */
+	bool registered; /* restore_files() runs at exit */
+} Files = {0};
+
+/* How many instructions run_proc() executes between updates of
+ * Live.ticks */
+enum { LIVE_TICKS = 1<<16 };
+
 /* The port rule table holds the logic between how processor nodes
  * interact with nodes of various types. */
 
@@ -71,6 +339,8 @@ struct PortRule {
 	Recvlet recv;
 };
 
+static bool send_none(Wire *wire, void *recp, int port, uint8_t dat);
+static bool recv_none(Wire *wire, void *recp, int port, uint8_t *dest);
 static bool send_proc(Wire *wire, void *recp, int port, uint8_t dat);
 static bool recv_proc(Wire *wire, void *recp, int port, uint8_t *dest);
 static bool send_io(Wire *wire, void *recp, int port, uint8_t dat);
@@ -79,96 +349,352 @@ static bool send_buf(Wire *wire, void *recp, int port, uint8_t dat);
 static bool recv_buf(Wire *wire, void *recp, int port, uint8_t *dest);
 static bool send_stack(Wire *wire, void *recp, int port, uint8_t dat);
 static bool recv_stack(Wire *wire, void *recp, int port, uint8_t *dest);
+static bool send_queue(Wire *wire, void *recp, int port, uint8_t dat);
+static bool recv_queue(Wire *wire, void *recp, int port, uint8_t *dest);
+static bool send_mem(Wire *wire, void *recp, int port, uint8_t dat);
+static bool recv_mem(Wire *wire, void *recp, int port, uint8_t *dest);
+static bool send_bcast(Wire *wire, void *recp, int port, uint8_t dat);
+static bool recv_bcast(Wire *wire, void *recp, int port, uint8_t *dest);
+static bool send_merge(Wire *wire, void *recp, int port, uint8_t dat);
+static bool recv_merge(Wire *wire, void *recp, int port, uint8_t *dest);
+static bool send_file(Wire *wire, void *recp, int port, uint8_t dat);
+static bool recv_file(Wire *wire, void *recp, int port, uint8_t *dest);
 
 static PortRule port_table[] = {
+	[NO_NODE]     = {&send_none,  &recv_none},
 	[PROC_NODE]   = {&send_proc,  &recv_proc},
 	[IO_NODE]     = {&send_io,    &recv_io},
 	[BUFFER_NODE] = {&send_buf,   &recv_buf},
 	[STACK_NODE]  = {&send_stack, &recv_stack},
+	[QUEUE_NODE]  = {&send_queue, &recv_queue},
+	[MEMORY_NODE] = {&send_mem,   &recv_mem},
+	[BROADCAST_NODE] = {&send_bcast, &recv_bcast},
+	[MERGE_NODE]  = {&send_merge, &recv_merge},
+	[FILE_NODE]   = {&send_file,  &recv_file},
 };
 
+/* The code of a processor with an empty body, which has nothing to
+ * run, so it halts */
+static const uint8_t empty_code[] = {OP_HALT};
+
+/* Point proc at block's code */
+static void
+set_code(ProcNode *proc, const CodeBlock *block)
+{
+	if (block->size == 0) {
+		proc->code = proc->isp = empty_code;
+		proc->code_end = &empty_code[1];
+		return;
+	}
+
+	proc->code = proc->isp = block->code;
+	proc->code_end = &block->code[block->size];
+}
+
+/* Make room for one more element in a node array */
+static void *
+reserve(void *arr, size_t *cap, size_t len, size_t size)
+{
+	if (len < *cap) return arr;
+
+	*cap = *cap ? *cap*2 : 8;
+	return erealloc(arr, *cap * size);
+}
+
 void
 vm_init(VM *vm, size_t nnodes, size_t nwires)
 {
 	memset(vm, 0, sizeof(*vm));
+	memset(&Live, 0, sizeof(Live));
 
 	vm->nodes = ecalloc(nnodes, sizeof(*vm->nodes));
 	vm->nnodes = nnodes;
-
-	vm->wires = ecalloc(nwires, sizeof(*vm->wires));
 	vm->nwires = nwires;
+	vm->wirenames = ecalloc(nwires, sizeof(*vm->wirenames));
+	vm->pool = ecalloc(1, sizeof(*vm->pool));
+}
+
+/* Copy out the running VM's counters. It only reads memory, so it's
+ * safe to call from a signal handler. */
+void
+vm_stats(VMStats *stats)
+{
+	*stats = Live;
+}
+
+/* Stop run() once the processors have executed a total of n
+ * instructions, even if some could go on. 0 is no limit. */
+void
+set_instr_budget(VM *vm, uint64_t n)
+{
+	vm->budget = n;
+}
+
+/* Limit how much of each stack node's data stays in memory, in bytes.
+ * Data beyond the limit spills to disk. */
+void
+set_stack_limit(VM *vm, size_t bytes)
+{
+	vm->pool->limit = bytes;
 }
 
 static Node *
-add_node(VM *vm, NodeType type)
+add_node(VM *vm, NodeType type, size_t idx)
 {
 	Node *node = &vm->nodes[vm->nodes_added++];
 
 	if (vm->nodes_added > vm->nnodes)
 		errx(1, "add_node(): too many nodes added");
+	if (vm->linked)
+		errx(1, "add_node(): VM is already running");
 
 	node->type = type;
+	node->idx = idx;
 	return node;
 }
 
 void
 add_io_node(VM *vm)
 {
-	add_node(vm, IO_NODE);
+	add_node(vm, IO_NODE, 0);
+}
+
+/* Append a processor to vm->procs and return it */
+static ProcNode *
+new_proc(VM *vm)
+{
+	size_t idx = vm->nprocs++;
+
+	/* The processor arrays all grow in step with each other. */
+	if (idx == vm->proccap) {
+		vm->proccap = vm->proccap ? vm->proccap*2 : 8;
+		vm->procs = erealloc(vm->procs,
+			vm->proccap * sizeof(*vm->procs));
+		vm->loaders = erealloc(vm->loaders,
+			vm->proccap * sizeof(*vm->loaders));
+		vm->decls = erealloc(vm->decls,
+			vm->proccap * PORT_MAX*sizeof(*vm->decls));
+	}
+
+	memset(&vm->procs[idx], 0, sizeof(vm->procs[idx]));
+	memset(&vm->loaders[idx], 0, sizeof(vm->loaders[idx]));
+	memset(&vm->decls[idx*PORT_MAX], 0, PORT_MAX*sizeof(*vm->decls));
+
+	add_node(vm, PROC_NODE, idx);
+	return &vm->procs[idx];
 }
 
 void
-add_proc_node(VM *vm, const uint8_t *code, uint16_t code_size)
+add_proc_node(VM *vm, const CodeBlock *block)
 {
-	Node *node = add_node(vm, PROC_NODE);
-	ProcNode *proc = ecalloc(1, sizeof(*proc));
-	node->dat = proc;
+	ProcNode *proc = new_proc(vm);
+	ProcLoader *loader = &vm->loaders[vm->nprocs-1];
+
+	set_code(proc, block);
+	loader->depth = block->depth;
+	loader->arrsize = block->arrsize;
+	loader->nvars = (uint16_t) block->nvars;
+	loader->nports = (uint16_t) block->nports;
+	loader->lines = block->lines;
+	loader->linesize = block->linesize;
+	loader->line = block->line;
+}
 
-	proc->code = proc->isp = code;
-	proc->code_end = &code[code_size];
+/*
+ * Add a processor whose code comes from load(dat) when it's needed,
+ * and which uses nports ports. If its body starts by receiving from
+ * wait_port, it's only loaded once a value is sent to that port, since
+ * until then it would be blocked anyway. A wait_port of -1, or one not
+ * wired to another processor, loads it on the first sweep.
+ */
+void
+add_lazy_proc_node(VM *vm, CodeLoader load, void *dat, int nports,
+	int wait_port)
+{
+	new_proc(vm);
 
-	/* initialize stack pointer */
-	proc->sp = proc->stack;
+	vm->loaders[vm->nprocs-1].load = load;
+	vm->loaders[vm->nprocs-1].dat = dat;
+	vm->loaders[vm->nprocs-1].nports = (uint16_t) nports;
+	vm->loaders[vm->nprocs-1].wait_port = wait_port;
 }
 
 void
 copy_proc_node(VM *vm, size_t source_node)
 {
-	ProcNode *source = vm->nodes[source_node].dat;
-	size_t size = (size_t)(source->code_end - source->code);
-	add_proc_node(vm, source->code, size);
+	size_t idx = vm->nodes[source_node].idx;
+	ProcNode *source = &vm->procs[idx];
+	CodeBlock block = {0};
+
+	if (!source->code) {
+		/* Share the source's loader, which compiles its body once. */
+		add_lazy_proc_node(vm, vm->loaders[idx].load, vm->loaders[idx].dat,
+			vm->loaders[idx].nports, vm->loaders[idx].wait_port);
+		return;
+	}
+
+	block.code = (uint8_t *) source->code;
+	block.size = (uint16_t) (source->code_end - source->code);
+	block.depth = vm->loaders[idx].depth;
+	block.arrsize = vm->loaders[idx].arrsize;
+	block.nvars = vm->loaders[idx].nvars;
+	block.nports = vm->loaders[idx].nports;
+	block.lines = (uint8_t *) vm->loaders[idx].lines;
+	block.linesize = vm->loaders[idx].linesize;
+	block.line = vm->loaders[idx].line;
+	add_proc_node(vm, &block);
 }
 
+/* Add a buffer node storing its BUFFER_NODE_MAX bytes in data, which
+ * the VM takes ownership of. data is from malloc(), or if mapped is
+ * set, from mmap(). */
 void
-add_buf_node(VM *vm, const uint8_t data[])
+add_buf_node(VM *vm, uint8_t *data, bool mapped)
 {
-	Node *node = add_node(vm, BUFFER_NODE);
-	BufNode *buf = ecalloc(1, sizeof(*buf));
-	node->dat = buf;
+	size_t idx = vm->nbufs++;
+	BufNode *buf;
+
+	vm->bufs = reserve(vm->bufs, &vm->bufcap, idx, sizeof(*vm->bufs));
+	buf = &vm->bufs[idx];
+	memset(buf, 0, sizeof(*buf));
+	buf->data = data;
+	buf->mapped = mapped;
 
-	memcpy(buf->data, data, sizeof(buf->data));
+	add_node(vm, BUFFER_NODE, idx);
 }
 
 void
 add_stack_node(VM *vm)
 {
-	Node *node = add_node(vm, STACK_NODE);
-	StackNode *stack = ecalloc(1, sizeof(*stack));
-	node->dat = stack;
+	size_t idx = vm->nstacks++;
+
+	vm->stacks = reserve(vm->stacks, &vm->stackcap, idx, sizeof(*vm->stacks));
+	memset(&vm->stacks[idx], 0, sizeof(vm->stacks[idx]));
+	vm->stacks[idx].pool = vm->pool;
+	vm->stacks[idx].fd = -1;
+
+	add_node(vm, STACK_NODE, idx);
+}
+
+/* Add a memory node storing its size bytes in data, which the VM takes
+ * ownership of, as add_buf_node() does. */
+void
+add_mem_node(VM *vm, size_t size, bool autoinc, uint8_t *data, bool mapped)
+{
+	size_t idx = vm->nmems++;
+	MemNode *mem;
+
+	vm->mems = reserve(vm->mems, &vm->memcap, idx, sizeof(*vm->mems));
+	mem = &vm->mems[idx];
+	memset(mem, 0, sizeof(*mem));
+	mem->data = data;
+	mem->size = size;
+	mem->autoinc = autoinc;
+	mem->mapped = mapped;
+
+	add_node(vm, MEMORY_NODE, idx);
+}
+
+void
+add_broadcast_node(VM *vm)
+{
+	size_t idx = vm->nbcasts++;
+
+	vm->bcasts = reserve(vm->bcasts, &vm->bcastcap, idx, sizeof(*vm->bcasts));
+	memset(&vm->bcasts[idx], 0, sizeof(vm->bcasts[idx]));
+
+	add_node(vm, BROADCAST_NODE, idx);
+}
+
+void
+add_merge_node(VM *vm)
+{
+	size_t idx = vm->nmerges++;
+
+	vm->merges = reserve(vm->merges, &vm->mergecap, idx, sizeof(*vm->merges));
+	memset(&vm->merges[idx], 0, sizeof(vm->merges[idx]));
+
+	add_node(vm, MERGE_NODE, idx);
 }
 
+/* Put back the flags of the file nodes' descriptors */
 static void
-add_wire_to_port(Port *port, Wire *wire, Node *recp, int recp_port)
+restore_files(void)
+{
+	if (!Files.vm) return;
+	for (size_t i = 0; i < Files.vm->nfiles; i++)
+		fcntl(Files.vm->files[i].fd, F_SETFL, Files.vm->files[i].flags);
+}
+
+/* Add a file node reading and/or writing fd, depending on how it was
+ * opened. The VM takes ownership of fd and makes it non-blocking until
+ * it's freed or the program exits. */
+void
+add_file_node(VM *vm, int fd)
 {
-	port->recp = recp;
-	port->recp_port = recp_port;
-	port->wire = wire;
+	size_t idx = vm->nfiles++;
+	FileNode *file;
+	int flags = fcntl(fd, F_GETFL);
+
+	if (flags < 0)
+		err(1, "file descriptor %d", fd);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+
+	if (!Files.registered) {
+		atexit(&restore_files);
+		Files.registered = true;
+	}
+	Files.vm = vm;
+
+	vm->files = reserve(vm->files, &vm->filecap, idx, sizeof(*vm->files));
+	file = &vm->files[idx];
+	memset(file, 0, sizeof(*file));
+	file->fd = fd;
+	file->flags = flags;
+	file->readable = (flags & O_ACCMODE) != O_WRONLY;
+	file->writable = (flags & O_ACCMODE) != O_RDONLY;
+
+	add_node(vm, FILE_NODE, idx);
 }
 
+/* Add a queue node holding up to capacity bytes, or any number of
+ * bytes if capacity is 0. */
 void
+add_queue_node(VM *vm, size_t capacity)
+{
+	size_t idx = vm->nqueues++;
+	QueueNode *queue;
+	size_t size = 16;
+
+	while (size < capacity)
+		size *= 2;
+
+	vm->queues = reserve(vm->queues, &vm->queuecap, idx, sizeof(*vm->queues));
+	queue = &vm->queues[idx];
+	memset(queue, 0, sizeof(*queue));
+	queue->data = ecalloc(size, 1);
+	queue->mask = size - 1;
+	queue->capacity = capacity;
+
+	add_node(vm, QUEUE_NODE, idx);
+}
+
+static void
+declare_port(VM *vm, Node *node, int port, size_t wire, size_t recp, int recp_port)
+{
+	PortDecl *decl = &vm->decls[node->idx*PORT_MAX + port];
+
+	decl->wired = true;
+	decl->node = recp;
+	decl->recp_port = recp_port;
+	decl->wire = wire;
+}
+
+/* Add a wire between two ports, and return its index */
+size_t
 add_wire(VM *vm, size_t node1, int port1, size_t node2, int port2)
 {
-	Wire *wire = &vm->wires[vm->wires_added++];
+	size_t wire = vm->wires_added++;
 	Node *n1, *n2;
 	if (vm->wires_added > vm->nwires)
 		errx(1, "add_wire(): too many wires added");
@@ -176,15 +702,300 @@ add_wire(VM *vm, size_t node1, int port1, size_t node2, int port2)
 	n1 = &vm->nodes[node1];
 	n2 = &vm->nodes[node2];
 
-	if (n1->type == PROC_NODE) {
-		ProcNode *proc = n1->dat;
-		add_wire_to_port(&proc->ports[port1], wire, n2, port2);
+	if (n1->type == PROC_NODE)
+		declare_port(vm, n1, port1, wire, node2, port2);
+
+	if (n2->type == PROC_NODE)
+		declare_port(vm, n2, port2, wire, node1, port1);
+
+	/* A broadcast only waits on the outputs that can be read. */
+	if (n1->type == BROADCAST_NODE && port1 != BROADCAST_IN)
+		vm->bcasts[n1->idx].wired |= UINT32_C(1) << (port1 - BROADCAST_OUT0);
+	if (n2->type == BROADCAST_NODE && port2 != BROADCAST_IN)
+		vm->bcasts[n2->idx].wired |= UINT32_C(1) << (port2 - BROADCAST_OUT0);
+
+	return wire;
+}
+
+static char *
+copy_name(const char *name)
+{
+	size_t len = strlen(name) + 1;
+	return memcpy(ecalloc(len, 1), name, len);
+}
+
+/* Name a node for reports. The name is copied. */
+void
+name_node(VM *vm, size_t node, const char *name)
+{
+	free(vm->nodes[node].name);
+	vm->nodes[node].name = copy_name(name);
+}
+
+/* Name a wire for reports. The name is copied. */
+void
+name_wire(VM *vm, size_t wire, const char *name)
+{
+	free(vm->wirenames[wire]);
+	vm->wirenames[wire] = copy_name(name);
+}
+
+/* Return a pointer to a node's data in its type's array */
+static void *
+node_data(VM *vm, const Node *node)
+{
+	switch (node->type) {
+	case PROC_NODE:   return &vm->procs[node->idx];
+	case BUFFER_NODE: return &vm->bufs[node->idx];
+	case STACK_NODE:  return &vm->stacks[node->idx];
+	case QUEUE_NODE:  return &vm->queues[node->idx];
+	case MEMORY_NODE: return &vm->mems[node->idx];
+	case BROADCAST_NODE: return &vm->bcasts[node->idx];
+	case MERGE_NODE:  return &vm->merges[node->idx];
+	case FILE_NODE:   return &vm->files[node->idx];
+	default:          return NULL;
+	}
+}
+
+/* Return how many bytes of variables a processor keeps below its stack */
+static size_t
+extra_vars(const ProcLoader *loader)
+{
+	return loader->nvars > SHORT_SLOTS ? loader->nvars - SHORT_SLOTS : 0;
+}
+
+/* Return how many ports processor i needs: as many as its code uses,
+ * and at least enough for its wires. */
+static int
+proc_nports(const VM *vm, size_t i)
+{
+	int nports = vm->loaders[i].nports;
+
+	for (int p = nports; p < PORT_MAX; p++) {
+		if (vm->decls[i*PORT_MAX + p].wired) nports = p + 1;
+	}
+
+	return nports;
+}
+
+/*
+ * Fix every node in place and resolve all ports into pointers. Each
+ * processor's ports are laid out in vm->portmem, directly followed by
+ * the wires it is the first (in sweep order) to use, so following a
+ * port to its wire stays close in memory. run() links the VM if it
+ * hasn't been already, so calling this first only moves the work.
+ */
+void
+link_vm(VM *vm)
+{
+	size_t *nowned = ecalloc(vm->nprocs, sizeof(*nowned));
+	Wire **placed = ecalloc(vm->nwires, sizeof(*placed));
+	bool *seen = ecalloc(vm->nwires, sizeof(*seen));
+	size_t *portsize = ecalloc(vm->nprocs, sizeof(*portsize));
+	size_t total = 0, stacktotal = 0;
+	uint8_t *stack;
+	char *region;
+
+	/* Count how many wires each processor owns */
+	for (size_t i = 0; i < vm->nprocs; i++) {
+		for (int p = 0; p < PORT_MAX; p++) {
+			PortDecl *decl = &vm->decls[i*PORT_MAX + p];
+			if (decl->wired && !seen[decl->wire]) {
+				seen[decl->wire] = true;
+				nowned[i]++;
+			}
+		}
+		portsize[i] = proc_nports(vm, i) * sizeof(Port);
+		total += portsize[i] + nowned[i]*sizeof(Wire);
+		stacktotal += extra_vars(&vm->loaders[i]) +
+			vm->loaders[i].depth + vm->loaders[i].arrsize;
 	}
 
-	if (n2->type == PROC_NODE) {
-		ProcNode *proc = n2->dat;
-		add_wire_to_port(&proc->ports[port2], wire, n1, port1);
+	vm->portmem = ecalloc(total, 1);
+	vm->stackmem = ecalloc(stacktotal + 1, 1);
+#ifdef OPSTATS
+	vm->opstats = ecalloc(1, sizeof(*vm->opstats));
+	vm->opstats->addrs = ecalloc(vm->nprocs, sizeof(*vm->opstats->addrs));
+#endif
+#ifdef PROFILE
+	vm->prof = ecalloc(1, sizeof(*vm->prof));
+	vm->prof->procs = ecalloc(vm->nprocs, sizeof(*vm->prof->procs));
+	vm->prof->wires = ecalloc(vm->nwires, sizeof(*vm->prof->wires));
+#endif
+
+	region = vm->portmem;
+	stack = vm->stackmem;
+	for (size_t i = 0; i < vm->nprocs; i++) {
+		ProcNode *proc = &vm->procs[i];
+		Wire *wires = (Wire *)(region + portsize[i]);
+
+		proc->ports = (Port *)region;
+		region += portsize[i] + nowned[i]*sizeof(Wire);
+
+		for (int p = 0; p < PORT_MAX; p++) {
+			PortDecl *decl = &vm->decls[i*PORT_MAX + p];
+			Port *port = &proc->ports[p];
+			Node *recp;
+
+			if (!decl->wired) continue;
+			if (!placed[decl->wire])
+				placed[decl->wire] = wires++;
+
+			recp = &vm->nodes[decl->node];
+			port->recp = node_data(vm, recp);
+			port->type = recp->type;
+			port->recp_port = decl->recp_port;
+			port->wire = placed[decl->wire];
+			port->wire->id = (uint32_t) decl->wire;
+#ifdef PROFILE
+			port->stats = &vm->prof->wires[decl->wire];
+#endif
+		}
+
+		/* Lazy processors get their stack once they're loaded */
+		stack += extra_vars(&vm->loaders[i]);
+		proc->stack = proc->sp = stack;
+		proc->stack_end = stack += vm->loaders[i].depth;
+		stack += vm->loaders[i].arrsize;
+	}
+
+	free(vm->decls);
+	vm->decls = NULL;
+	free(seen);
+	free(placed);
+	free(portsize);
+	free(nowned);
+	vm->linked = true;
+}
+
+/* Free a buffer or memory node's data */
+static void
+free_data(uint8_t *data, size_t size, bool mapped)
+{
+	if (mapped) munmap(data, size);
+	else free(data);
+}
+
+/* Free everything the VM owns, including the data and descriptors
+ * handed to it. Code blocks belong to the caller. */
+void
+vm_free(VM *vm)
+{
+	for (size_t i = 0; i < vm->nnodes; i++)
+		free(vm->nodes[i].name);
+	for (size_t i = 0; i < vm->nwires; i++)
+		free(vm->wirenames[i]);
+
+	/* Lazy processors got their own slab when they were loaded */
+	for (size_t i = 0; i < vm->nprocs; i++) {
+		if (vm->loaders[i].load && vm->procs[i].code)
+			free(vm->procs[i].stack - extra_vars(&vm->loaders[i]));
+	}
+
+	for (size_t i = 0; i < vm->nbufs; i++)
+		free_data(vm->bufs[i].data, BUFFER_NODE_MAX, vm->bufs[i].mapped);
+	for (size_t i = 0; i < vm->nstacks; i++) {
+		StackNode *stack = &vm->stacks[i];
+
+		for (size_t c = stack->nspilled; c < stack->nchunks; c++)
+			free(stack->chunks[c]);
+		free(stack->chunks);
+		if (stack->fd >= 0) close(stack->fd);
+	}
+	while (vm->pool->free) {
+		Chunk *chunk = vm->pool->free;
+
+		vm->pool->free = chunk->u.next;
+		free(chunk);
+	}
+	for (size_t i = 0; i < vm->nqueues; i++)
+		free(vm->queues[i].data);
+	for (size_t i = 0; i < vm->nmems; i++)
+		free_data(vm->mems[i].data, vm->mems[i].size, vm->mems[i].mapped);
+	for (size_t i = 0; i < vm->nfiles; i++) {
+		fcntl(vm->files[i].fd, F_SETFL, vm->files[i].flags);
+		close(vm->files[i].fd);
+	}
+	if (Files.vm == vm) Files.vm = NULL;
+
+#ifdef PROFILE
+	if (vm->prof) {
+		free(vm->prof->procs);
+		free(vm->prof->wires);
+		free(vm->prof);
 	}
+#endif
+#ifdef OPSTATS
+	if (vm->opstats) {
+		for (size_t i = 0; i < vm->nprocs; i++)
+			free(vm->opstats->addrs[i]);
+		free(vm->opstats->addrs);
+		free(vm->opstats);
+	}
+#endif
+
+	free(vm->nodes);
+	free(vm->procs);
+	free(vm->loaders);
+	free(vm->decls);
+	free(vm->bufs);
+	free(vm->stacks);
+	free(vm->pool);
+	free(vm->queues);
+	free(vm->mems);
+	free(vm->bcasts);
+	free(vm->merges);
+	free(vm->files);
+	free(vm->wires);
+	free(vm->wirenames);
+	free(vm->stackmem);
+	free(vm->portmem);
+	memset(vm, 0, sizeof(*vm));
+}
+
+/* A port that a processor uses, but that was never wired. Every port
+ * must be wired, but that isn't checked while loading, so this is
+ * where such a program stops. */
+static bool
+send_none(Wire *wire, void *recp, int port, uint8_t dat)
+{
+	(void)wire;
+	(void)recp;
+	(void)port;
+	(void)dat;
+
+	runtime_error("send(): port is not wired");
+	return false;
+}
+
+static bool
+recv_none(Wire *wire, void *recp, int port, uint8_t *dest)
+{
+	(void)wire;
+	(void)recp;
+	(void)port;
+	(void)dest;
+
+	runtime_error("recv(): port is not wired");
+	return false;
+}
+
+/* Start the flow of a value put on a wire */
+static void
+trace_send(const Wire *wire)
+{
+	Tracer.flows[wire->id] = ++Tracer.nextflow;
+	Tracer.flowed = true;
+	trace_flow(Tracer.tid, Tracer.vm->wirenames[wire->id],
+		Tracer.nextflow, true, Tracer.start);
+}
+
+/* End the flow of a value taken off a wire */
+static void
+trace_recv(const Wire *wire)
+{
+	trace_flow(Tracer.tid, Tracer.vm->wirenames[wire->id],
+		Tracer.flows[wire->id], false, Tracer.start);
 }
 
 static bool
@@ -197,6 +1008,7 @@ send_proc(Wire *wire, void *recp, int port, uint8_t dat)
 	case EMPTY:
 		wire->status = FULL;
 		wire->buf = dat;
+		if (Tracer.on) trace_send(wire);
 		return false;
 	case FULL:
 		return false;
@@ -204,7 +1016,8 @@ send_proc(Wire *wire, void *recp, int port, uint8_t dat)
 		wire->status = EMPTY;
 		return true;
 	default:
-		errx(1, "send_proc(): invalid status");
+		runtime_error("send_proc(): invalid status");
+		return false;
 	}
 }
 
@@ -221,9 +1034,11 @@ recv_proc(Wire *wire, void *recp, int port, uint8_t *dest)
 	case FULL:
 		*dest = wire->buf;
 		wire->status = CONSUMED;
+		if (Tracer.on) trace_recv(wire);
 		return true;
 	default:
-		errx(1, "recv_proc(): invalid status");
+		runtime_error("recv_proc(): invalid status");
+		return false;
 	}
 }
 
@@ -241,9 +1056,10 @@ send_io(Wire *wire, void *recp, int port, uint8_t dat)
 		putc(dat, stderr);
 		break;
 	default:
-		errx(1, "send_io(): invalid port %d.", port);
+		runtime_error("send_io(): invalid port %d.", port);
 		break;
 	}
+	Live.bytes_out++;
 	return true;
 }
 
@@ -255,13 +1071,19 @@ recv_io(Wire *wire, void *recp, int port, uint8_t *dest)
 	int chr;
 
 	if (port != IO_IN)
-		errx(1, "recv_io(): invalid port %d.", port);
+		runtime_error("recv_io(): invalid port %d.", port);
 
 	chr = getchar();
 	if (chr == EOF) {
+		/* No data yet, rather than no more */
+		if (ferror(stdin) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			clearerr(stdin);
+			IO.rwait = true;
+		}
 		return false;
 	} else {
 		*dest = (uint8_t) chr;
+		Live.bytes_in++;
 		return true;
 	}
 }
@@ -279,7 +1101,7 @@ static bool send_buf(Wire *wire, void *recp, int port, uint8_t dat)
 		buf->data[buf->idx] = dat;
 		break;
 	default:
-		errx(1, "send_buf(): invalid port %d.", port);
+		runtime_error("send_buf(): invalid port %d.", port);
 	}
 
 	return true;
@@ -298,85 +1120,582 @@ static bool recv_buf(Wire *wire, void *recp, int port, uint8_t *dest)
 		*dest = buf->data[buf->idx];
 		break;
 	default:
-		errx(1, "send_buf(): invalid port %d.", port);
+		runtime_error("send_buf(): invalid port %d.", port);
 	}
 
 	return true;
 }
 
-static bool send_stack(Wire *wire, void *recp, int port, uint8_t dat)
+static Chunk *
+take_chunk(ChunkPool *pool)
 {
-	(void)wire;
-	(void)port;
-	StackNode *stack = recp;
+	Chunk *chunk = pool->free;
 
-	bytevec_append(&stack->vec, dat);
-	return true;
+	if (!chunk) {
+		Live.stack_bytes += sizeof(*chunk);
+		return ecalloc(1, sizeof(*chunk));
+	}
+
+	pool->free = chunk->u.next;
+	pool->nfree--;
+	return chunk;
 }
 
-static bool recv_stack(Wire *wire, void *recp, int port, uint8_t *dest)
+static void
+give_chunk(ChunkPool *pool, Chunk *chunk)
 {
-	(void)wire;
-	(void)port;
-	StackNode *stack = recp;
-
-	if (stack->vec.len > 0) {
-		*dest = stack->vec.buf[--stack->vec.len];
-		return true;
-	} else {
-		return false;
+	if (pool->nfree == POOL_MAX) {
+		Live.stack_bytes -= sizeof(*chunk);
+		free(chunk);
+		return;
 	}
-}
 
-
-static bool
-send(Port *port, uint8_t dat)
-{
-	Sendlet snd = port_table[port->recp->type].send;
-	return snd(port->wire, port->recp->dat, port->recp_port, dat);
+	chunk->u.next = pool->free;
+	pool->free = chunk;
+	pool->nfree++;
 }
 
-static bool
-recv(Port *port, uint8_t *dest)
+/* Write data to chunk i of a stack's spill file, or if reading is set,
+ * read chunk i into data */
+static void
+spill_io(StackNode *stack, size_t i, uint8_t *data, bool reading)
 {
-	Recvlet rcv = port_table[port->recp->type].recv;
-	return rcv(port->wire, port->recp->dat, port->recp_port, dest);
+	off_t off = (off_t) (i * STACK_CHUNK);
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < STACK_CHUNK) {
+		n = reading
+			? pread(stack->fd, data + done, STACK_CHUNK - done,
+				off + (off_t) done)
+			: pwrite(stack->fd, data + done, STACK_CHUNK - done,
+				off + (off_t) done);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			err(1, "stack node spill file");
+		}
+		if (n == 0)
+			errx(1, "stack node spill file: short read");
+		done += (size_t) n;
+	}
 }
 
+/* Move the stack's bottom resident chunk to its spill file, creating
+ * the file if needed. The file is unlinked as soon as it's opened, so
+ * it's cleaned up however the program exits. */
 static void
-push(ProcNode *proc, uint8_t dat)
+spill_chunk(StackNode *stack)
 {
-	if (proc->sp == &proc->stack[STACK_SIZE])
-		errx(1, "push(): stack overflow");
+	size_t i = stack->nspilled++;
 
-	*proc->sp++ = dat;
+	if (stack->fd < 0) {
+		const char *dir = getenv("TMPDIR");
+		char path[4096];
+
+		snprintf(path, sizeof(path), "%s/noded-stack.XXXXXX",
+			dir ? dir : "/tmp");
+		if ((stack->fd = mkstemp(path)) < 0)
+			err(1, "%s", path);
+		unlink(path);
+	}
+
+	spill_io(stack, i, stack->chunks[i]->u.data, false);
+	give_chunk(stack->pool, stack->chunks[i]);
+	stack->chunks[i] = NULL;
+	Live.spilled_bytes += STACK_CHUNK;
 }
 
-static uint8_t
-pop(ProcNode *proc)
+/* Bring the top spilled chunk back into memory, and drop it from the
+ * spill file */
+static void
+unspill_chunk(StackNode *stack)
 {
-	if (proc->sp == proc->stack)
-		errx(1, "pop(): stack underflow");
+	size_t i = --stack->nspilled;
 
-	return *(--proc->sp);
+	stack->chunks[i] = take_chunk(stack->pool);
+	spill_io(stack, i, stack->chunks[i]->u.data, true);
+	if (ftruncate(stack->fd, (off_t) (i * STACK_CHUNK)) < 0)
+		err(1, "stack node spill file");
+	Live.spilled_bytes -= STACK_CHUNK;
 }
 
-static uint8_t
-peekproc(ProcNode *proc)
+static bool send_stack(Wire *wire, void *recp, int port, uint8_t dat)
 {
-	if (proc->sp == proc->stack)
-		errx(1, "peek(): stack underflow");
+	(void)wire;
+	(void)port;
+	StackNode *stack = recp;
+	size_t limit = stack->pool->limit;
+
+	if (stack->nchunks == 0 || stack->toplen == STACK_CHUNK) {
+		/* Start a new chunk, first making room under the limit. */
+		size_t resident = stack->nchunks - stack->nspilled;
+		if (limit && resident > 0 && (resident+1)*STACK_CHUNK > limit)
+			spill_chunk(stack);
+
+		stack->chunks = reserve(stack->chunks, &stack->chunkcap,
+			stack->nchunks, sizeof(*stack->chunks));
+		stack->chunks[stack->nchunks++] = take_chunk(stack->pool);
+		stack->toplen = 0;
+	}
 
-	return *(proc->sp - 1);
+	stack->chunks[stack->nchunks-1]->u.data[stack->toplen++] = dat;
+	return true;
 }
 
-static bool tick(ProcNode *proc)
+static bool recv_stack(Wire *wire, void *recp, int port, uint8_t *dest)
+{
+	(void)wire;
+	(void)port;
+	StackNode *stack = recp;
+
+	if (stack->nchunks == 0) return false;
+
+	*dest = stack->chunks[stack->nchunks-1]->u.data[--stack->toplen];
+
+	if (stack->toplen == 0) {
+		/* Return the drained chunk, and make sure the new top
+		 * chunk is in memory. */
+		give_chunk(stack->pool, stack->chunks[--stack->nchunks]);
+		stack->toplen = STACK_CHUNK;
+		if (stack->nchunks > 0 && stack->nchunks == stack->nspilled)
+			unspill_chunk(stack);
+	}
+
+	return true;
+}
+
+static bool send_queue(Wire *wire, void *recp, int port, uint8_t dat)
+{
+	(void)wire;
+	(void)port;
+	QueueNode *queue = recp;
+	size_t size = queue->mask + 1;
+
+	if (queue->capacity && queue->len == queue->capacity)
+		return false;
+
+	if (queue->len == size) {
+		/* Double the ring, unwrapping its contents to the start */
+		uint8_t *data = ecalloc(size*2, 1);
+
+		memcpy(data, &queue->data[queue->head], size - queue->head);
+		memcpy(&data[size - queue->head], queue->data, queue->head);
+		free(queue->data);
+		queue->data = data;
+		queue->head = 0;
+		queue->mask = size*2 - 1;
+	}
+
+	queue->data[(queue->head + queue->len++) & queue->mask] = dat;
+	return true;
+}
+
+static bool recv_queue(Wire *wire, void *recp, int port, uint8_t *dest)
+{
+	(void)wire;
+	(void)port;
+	QueueNode *queue = recp;
+
+	if (queue->len == 0) return false;
+
+	*dest = queue->data[queue->head];
+	queue->head = (queue->head + 1) & queue->mask;
+	queue->len--;
+	return true;
+}
+
+/* Return the element at a memory node's address, and step to the next
+ * one in autoinc mode. Addresses past the end wrap around, so that as
+ * with buffers, no access is out of bounds. */
+static uint8_t *
+mem_elm(MemNode *mem)
+{
+	uint8_t *elm;
+
+	if (mem->addr >= mem->size)
+		mem->addr %= mem->size;
+
+	elm = &mem->data[mem->addr];
+	if (mem->autoinc && ++mem->addr == mem->size)
+		mem->addr = 0;
+
+	return elm;
+}
+
+static bool send_mem(Wire *wire, void *recp, int port, uint8_t dat)
+{
+	(void)wire;
+	MemNode *mem = recp;
+
+	switch (port) {
+	case MEMORY_ELM:
+		*mem_elm(mem) = dat;
+		break;
+	case MEMORY_LO:
+		mem->addr = (mem->addr & 0xFF00) | dat;
+		break;
+	case MEMORY_HI:
+		mem->addr = (mem->addr & 0x00FF) | (size_t) dat << 8;
+		break;
+	default:
+		runtime_error("send_mem(): invalid port %d.", port);
+	}
+
+	return true;
+}
+
+static bool recv_mem(Wire *wire, void *recp, int port, uint8_t *dest)
+{
+	(void)wire;
+	MemNode *mem = recp;
+
+	switch (port) {
+	case MEMORY_ELM:
+		*dest = *mem_elm(mem);
+		break;
+	case MEMORY_LO:
+		*dest = mem->addr & 0xFF;
+		break;
+	case MEMORY_HI:
+		*dest = (mem->addr >> 8) & 0xFF;
+		break;
+	default:
+		runtime_error("recv_mem(): invalid port %d.", port);
+	}
+
+	return true;
+}
+
+static bool send_bcast(Wire *wire, void *recp, int port, uint8_t dat)
+{
+	(void)wire;
+	BroadcastNode *bcast = recp;
+
+	if (port != BROADCAST_IN)
+		runtime_error("send_bcast(): cannot send to output port %d.", port);
+	if (bcast->pending) return false;
+
+	bcast->val = dat;
+	bcast->pending = bcast->wired;
+	return true;
+}
+
+static bool recv_bcast(Wire *wire, void *recp, int port, uint8_t *dest)
+{
+	(void)wire;
+	BroadcastNode *bcast = recp;
+	uint32_t bit;
+
+	if (port == BROADCAST_IN)
+		runtime_error("recv_bcast(): cannot receive from input port.");
+
+	bit = UINT32_C(1) << (port - BROADCAST_OUT0);
+	if (!(bcast->pending & bit)) return false;
+
+	*dest = bcast->val;
+	bcast->pending &= ~bit;
+	return true;
+}
+
+static bool send_merge(Wire *wire, void *recp, int port, uint8_t dat)
+{
+	(void)wire;
+	MergeNode *merge = recp;
+	int in = port - MERGE_IN0;
+
+	if (port == MERGE_OUT)
+		runtime_error("send_merge(): cannot send to output port.");
+	if (merge->full & (UINT32_C(1) << in)) return false;
+
+	merge->vals[in] = dat;
+	merge->full |= UINT32_C(1) << in;
+	return true;
+}
+
+static bool recv_merge(Wire *wire, void *recp, int port, uint8_t *dest)
+{
+	(void)wire;
+	MergeNode *merge = recp;
+
+	if (port != MERGE_OUT)
+		runtime_error("recv_merge(): cannot receive from input port %d.", port);
+	if (!merge->full) return false;
+
+	for (int i = 0; i < ROUTE_MAX; i++) {
+		int in = (merge->next + i) % ROUTE_MAX;
+
+		if (merge->full & (UINT32_C(1) << in)) {
+			*dest = merge->vals[in];
+			merge->full &= ~(UINT32_C(1) << in);
+			merge->next = (in + 1) % ROUTE_MAX;
+			break;
+		}
+	}
+
+	return true;
+}
+
+/* Write out as much of a file node's buffer as the descriptor takes
+ * without blocking. */
+static void
+flush_file(FileNode *file)
+{
+	size_t done = 0;
+	ssize_t n;
+
+	while (done < file->wlen) {
+		n = write(file->fd, &file->wbuf[done], file->wlen - done);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+			err(1, "write to file node");
+		}
+		done += (size_t) n;
+	}
+
+	memmove(file->wbuf, &file->wbuf[done], file->wlen - done);
+	file->wlen -= done;
+}
+
+static bool send_file(Wire *wire, void *recp, int port, uint8_t dat)
+{
+	(void)wire;
+	(void)port;
+	FileNode *file = recp;
+
+	if (!file->writable)
+		runtime_error("send_file(): node is not writable.");
+
+	if (file->wlen == FILE_BUF) {
+		flush_file(file);
+		if (file->wlen == FILE_BUF) {
+			file->wwait = true;
+			return false;
+		}
+	}
+
+	file->wbuf[file->wlen++] = dat;
+	return true;
+}
+
+static bool recv_file(Wire *wire, void *recp, int port, uint8_t *dest)
+{
+	(void)wire;
+	(void)port;
+	FileNode *file = recp;
+	ssize_t n;
+
+	if (!file->readable)
+		runtime_error("recv_file(): node is not readable.");
+
+	while (file->rpos == file->rlen) {
+		if (file->eof) return false;
+
+		n = read(file->fd, file->rbuf, sizeof(file->rbuf));
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				file->rwait = true;
+				return false;
+			}
+			err(1, "read from file node");
+		}
+
+		file->eof = n == 0;
+		file->rpos = 0;
+		file->rlen = (size_t) n;
+	}
+
+	*dest = file->rbuf[file->rpos++];
+	return true;
+}
+
+
+#ifdef PROFILE
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + (uint64_t) ts.tv_nsec;
+}
+
+static void
+prof_stall(uint64_t *stalls, uint64_t *ns, uint64_t *since, bool ok)
+{
+	if (!ok) {
+		(*stalls)++;
+		if (!*since) *since = now_ns();
+	} else if (*since) {
+		*ns += now_ns() - *since;
+		*since = 0;
+	}
+}
+
+static void
+prof_send(const Port *port, bool ok)
+{
+	WireStats *wire = port->stats;
+
+	if (ok) {
+		Globals.cur->sends++;
+		wire->messages++;
+	} else {
+		Globals.cur->send_fails++;
+	}
+	prof_stall(&wire->send_stalls, &wire->send_ns, &wire->send_since, ok);
+}
+
+static void
+prof_recv(const Port *port, bool ok)
+{
+	WireStats *wire = port->stats;
+
+	/* Messages between processors were already counted by the
+	 * sender. */
+	if (ok) {
+		Globals.cur->recvs++;
+		if (port->type != PROC_NODE) wire->messages++;
+	} else {
+		Globals.cur->recv_fails++;
+	}
+	prof_stall(&wire->recv_stalls, &wire->recv_ns, &wire->recv_since, ok);
+}
+
+static void
+prof_instr(void)
+{
+	Globals.cur->instrs++;
+}
+
+static void
+prof_halt(void)
+{
+	if (!Globals.cur->halt_ns) Globals.cur->halt_ns = now_ns();
+}
+
+static void
+prof_run(VM *vm, size_t i, bool progressed)
+{
+	ProcStats *stats = &vm->prof->procs[i];
+
+	if (progressed)
+		stats->runs++;
+	else if (!stats->halt_ns)
+		stats->blocked++;
+}
+#else
+/* Without PROFILE, the hooks compile away to nothing */
+static void prof_send(const Port *port, bool ok) { (void)port; (void)ok; }
+static void prof_recv(const Port *port, bool ok) { (void)port; (void)ok; }
+static void prof_instr(void) {}
+static void prof_halt(void) {}
+static void prof_run(VM *vm, size_t i, bool progressed)
+{
+	(void)vm; (void)i; (void)progressed;
+}
+#endif
+
+#ifdef OPSTATS
+/* Start counting dispatches for processor i */
+static void
+op_select(VM *vm, size_t i)
+{
+	OpStats *stats = vm->opstats;
+	ProcNode *proc = &vm->procs[i];
+
+	if (!stats->addrs[i]) {
+		stats->addrs[i] = ecalloc((size_t) (proc->code_end - proc->code),
+			sizeof(*stats->addrs[i]));
+	}
+
+	Globals.opstats = stats;
+	Globals.addrs = stats->addrs[i];
+	Globals.prev = NUM_OPCODES;
+}
+
+static void
+op_count(const ProcNode *proc, Opcode op)
+{
+	if (op >= NUM_OPCODES) return; /* tick() reports it */
+
+	Globals.opstats->ops[op]++;
+	if (Globals.prev != NUM_OPCODES)
+		Globals.opstats->pairs[Globals.prev][op]++;
+	Globals.addrs[proc->isp - proc->code]++;
+	Globals.prev = op;
+}
+#else
+static void op_select(VM *vm, size_t i) { (void)vm; (void)i; }
+static void op_count(const ProcNode *proc, Opcode op) { (void)proc; (void)op; }
+#endif
+
+static bool
+send(Port *port, uint8_t dat)
+{
+	Sendlet snd = port_table[port->type].send;
+	bool ok = snd(port->wire, port->recp, port->recp_port, dat);
+
+	Live.messages += ok;
+	prof_send(port, ok);
+	return ok;
+}
+
+static bool
+recv(Port *port, uint8_t *dest)
+{
+	Recvlet rcv = port_table[port->type].recv;
+	bool ok = rcv(port->wire, port->recp, port->recp_port, dest);
+
+	prof_recv(port, ok);
+	return ok;
+}
+
+static void
+push(ProcNode *proc, uint8_t dat)
+{
+	if (proc->sp == proc->stack_end)
+		runtime_error("push(): stack overflow");
+
+	*proc->sp++ = dat;
+}
+
+static uint8_t
+pop(ProcNode *proc)
+{
+	if (proc->sp == proc->stack)
+		runtime_error("pop(): stack underflow");
+
+	return *(--proc->sp);
+}
+
+static uint8_t
+peekproc(ProcNode *proc)
+{
+	if (proc->sp == proc->stack)
+		runtime_error("peek(): stack underflow");
+
+	return *(proc->sp - 1);
+}
+
+/* Return variable n, which is either in the processor itself or just
+ * below its stack. */
+static uint8_t *
+var(ProcNode *proc, uint8_t n)
+{
+	if (n < SHORT_SLOTS) return &proc->vars[n];
+	return &proc->stack[SHORT_SLOTS - 1 - n];
+}
+
+static bool tick(ProcNode *proc)
 {
 	int advance = 1;
 	Opcode op = proc->isp[0];
 	uint8_t arg1, arg2;
 	uint16_t addr;
 
+	op_count(proc, op);
 	switch (op) {
 	case OP_NOOP:
 		break;
@@ -435,12 +1754,12 @@ static bool tick(ProcNode *proc)
 	case OP_SHL:
 		arg2 = pop(proc);
 		arg1 = pop(proc);
-		push(proc, arg1 << arg2);
+		push(proc, arg2 < 8 ? arg1 << arg2 : 0);
 		break;
 	case OP_SHR:
 		arg2 = pop(proc);
 		arg1 = pop(proc);
-		push(proc, arg1 >> arg2);
+		push(proc, arg2 < 8 ? arg1 >> arg2 : 0);
 		break;
 	case OP_ADD:
 		push(proc, pop(proc) + pop(proc));
@@ -456,11 +1775,13 @@ static bool tick(ProcNode *proc)
 	case OP_DIV:
 		arg2 = pop(proc);
 		arg1 = pop(proc);
+		if (!arg2) runtime_error("Division by zero.");
 		push(proc, arg1 / arg2);
 		break;
 	case OP_MOD:
 		arg2 = pop(proc);
 		arg1 = pop(proc);
+		if (!arg2) runtime_error("Division by zero.");
 		push(proc, arg1 % arg2);
 		break;
 	case OP_JMP:
@@ -489,6 +1810,25 @@ static bool tick(ProcNode *proc)
 	case OP_SAVE3:
 		proc->vars[op - OP_SAVE0] = pop(proc);
 		break;
+	case OP_LOAD:
+		advance = 2;
+		push(proc, *var(proc, proc->isp[1]));
+		break;
+	case OP_SAVE:
+		advance = 2;
+		*var(proc, proc->isp[1]) = pop(proc);
+		break;
+	case OP_ALOAD:
+		advance = 3;
+		arg1 = pop(proc) % (proc->isp[2] + 1);
+		push(proc, proc->stack_end[proc->isp[1] + arg1]);
+		break;
+	case OP_ASTORE:
+		advance = 3;
+		arg2 = pop(proc);
+		arg1 = pop(proc) % (proc->isp[2] + 1);
+		proc->stack_end[proc->isp[1] + arg1] = arg2;
+		break;
 	case OP_SEND0:
 	case OP_SEND1:
 	case OP_SEND2:
@@ -509,12 +1849,31 @@ static bool tick(ProcNode *proc)
 			return false;
 		}
 		break;
+	case OP_SEND:
+		advance = 2;
+		if (send(&proc->ports[proc->isp[1]], peekproc(proc))) {
+			pop(proc);
+		} else {
+			return false;
+		}
+		break;
+	case OP_RECV:
+		advance = 2;
+		if (recv(&proc->ports[proc->isp[1]], &arg1)) {
+			push(proc, arg1);
+		} else {
+			return false;
+		}
+		break;
 	case OP_HALT:
+		prof_halt();
 		return false;
 	default:
-		errx(1, "Invalid operand %d.", op);
+		runtime_error("Invalid operand %d.", op);
 	}
 
+	prof_instr();
+
 	/* set isp to next instruction and wrap to beginning if necessary */
 	proc->isp += advance;
 	if (proc->isp == proc->code_end)
@@ -522,21 +1881,545 @@ static bool tick(ProcNode *proc)
 	return true;
 }
 
-static bool run_proc(ProcNode *node)
+/* Whether a lazy processor has anything to do yet */
+static bool
+wants_load(const ProcNode *proc, const ProcLoader *loader)
 {
-	if (!tick(node)) return false;
-	while (tick(node));
-	return true;
+	const Port *port;
+
+	if (loader->wait_port < 0) return true;
+	port = &proc->ports[loader->wait_port];
+	return port->type != PROC_NODE || port->wire->status == FULL;
+}
+
+static void
+load_proc(ProcNode *proc, ProcLoader *loader)
+{
+	const CodeBlock *block = loader->load(loader->dat);
+	uint8_t *slab;
+
+	set_code(proc, block);
+
+	loader->depth = block->depth;
+	loader->arrsize = block->arrsize;
+	loader->nvars = (uint16_t) block->nvars;
+	loader->lines = block->lines;
+	loader->linesize = block->linesize;
+	loader->line = block->line;
+	slab = ecalloc(extra_vars(loader) + block->depth + block->arrsize + 1, 1);
+	proc->stack = proc->sp = slab + extra_vars(loader);
+	proc->stack_end = proc->stack + block->depth;
+}
+
+/* Make room for processor i's samples, now that its code is loaded */
+static void
+sample_proc(const VM *vm, size_t i)
+{
+	const ProcNode *proc = &vm->procs[i];
+
+	if (!Sampler.counts || Sampler.counts[i] || !proc->code) return;
+	Sampler.counts[i] = ecalloc((size_t) (proc->code_end - proc->code) + 1,
+		sizeof(*Sampler.counts[i]));
+}
+
+static void
+on_sample(int sig)
+{
+	size_t cur = Sampler.cur;
+	const ProcNode *proc;
+	(void)sig;
+
+	if (cur < Sampler.vm->nprocs && Sampler.counts[cur]) {
+		proc = &Sampler.vm->procs[cur];
+		if (proc->isp >= proc->code && proc->isp < proc->code_end) {
+			Sampler.counts[cur][proc->isp - proc->code]++;
+			return;
+		}
+	}
+
+	Sampler.other++;
+}
+
+/* Start sampling the running processor every interval_us microseconds
+ * of CPU time */
+void
+start_sampling(const VM *vm, long interval_us)
+{
+	struct sigaction sa = {0};
+	struct sigevent sev = {0};
+	struct itimerspec its = {0};
+
+	Sampler.vm = vm;
+	Sampler.counts = ecalloc(vm->nprocs, sizeof(*Sampler.counts));
+	for (size_t i = 0; i < vm->nprocs; i++)
+		sample_proc(vm, i);
+
+	sa.sa_handler = &on_sample;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, NULL) < 0)
+		err(1, "sigaction");
+
+	sev.sigev_notify = SIGEV_SIGNAL;
+	sev.sigev_signo = SIGPROF;
+	if (timer_create(CLOCK_PROCESS_CPUTIME_ID, &sev, &Sampler.timer) < 0)
+		err(1, "timer_create");
+
+	its.it_interval.tv_sec = interval_us / 1000000;
+	its.it_interval.tv_nsec = interval_us % 1000000 * 1000;
+	its.it_value = its.it_interval;
+	if (timer_settime(Sampler.timer, 0, &its, NULL) < 0)
+		err(1, "timer_settime");
+}
+
+/*
+ * Stop sampling and write the samples as folded stacks, one
+ * `processor;FILE:LINE count` line per source line, for flame graph
+ * tools. Samples taken outside any processor are under `[vm]`.
+ */
+void
+write_samples(const VM *vm, FILE *f, const char *fname)
+{
+	struct itimerspec its = {0};
+	uint32_t *bylines = NULL;
+	size_t cap = 0;
+
+	if (!Sampler.counts) return;
+	timer_settime(Sampler.timer, 0, &its, NULL);
+	signal(SIGPROF, SIG_IGN);
+
+	for (size_t i = 0; i < vm->nnodes; i++) {
+		const Node *node = &vm->nodes[i];
+		const ProcLoader *loader;
+		const ProcNode *proc;
+		const uint32_t *counts;
+		size_t size, nlines = 0;
+
+		if (node->type != PROC_NODE) continue;
+		if (!(counts = Sampler.counts[node->idx])) continue;
+		proc = &vm->procs[node->idx];
+		loader = &vm->loaders[node->idx];
+		size = (size_t) (proc->code_end - proc->code);
+
+		/* Add up each line's samples */
+		for (size_t a = 0; a < size; a++) {
+			size_t line;
+
+			if (!counts[a]) continue;
+			line = (size_t) code_line(loader->lines, loader->linesize,
+				(uint16_t) a);
+			if (line >= cap) {
+				size_t oldcap = cap;
+				cap = line*2 + 16;
+				bylines = erealloc(bylines, cap * sizeof(*bylines));
+				memset(&bylines[oldcap], 0,
+					(cap - oldcap) * sizeof(*bylines));
+			}
+			if (line >= nlines) nlines = line + 1;
+			bylines[line] += counts[a];
+		}
+
+		for (size_t line = 0; line < nlines; line++) {
+			if (!bylines[line]) continue;
+			fprintf(f, "%s;%s:%zu %lu\n",
+				node->name ? node->name : "?", fname,
+				(size_t) loader->line + line,
+				(unsigned long) bylines[line]);
+			bylines[line] = 0;
+		}
+	}
+
+	if (Sampler.other)
+		fprintf(f, "[vm] %lu\n", (unsigned long) Sampler.other);
+	free(bylines);
+}
+
+/* Start tracing the VM's runs. trace_open() must be called first. */
+void
+start_tracing(const VM *vm)
+{
+	Tracer.vm = vm;
+	Tracer.on = true;
+	Tracer.flows = ecalloc(vm->nwires, sizeof(*Tracer.flows));
+	Tracer.names = ecalloc(vm->nprocs, sizeof(*Tracer.names));
+
+	trace_thread(0, "run()");
+	for (size_t i = 0; i < vm->nnodes; i++) {
+		const Node *node = &vm->nodes[i];
+		if (node->type != PROC_NODE) continue;
+		Tracer.names[node->idx] = node->name;
+		trace_thread((uint32_t) node->idx + 1, node->name);
+	}
+}
+
+/* Trace a processor run that just ended. Only runs that made progress
+ * or put a value on a wire get a span; blocked runs are gaps. */
+static void
+trace_run(bool progressed)
+{
+	uint64_t now;
+
+	if (!Tracer.on) return;
+
+	now = trace_clock();
+	if (progressed || Tracer.flowed) {
+		trace_span(Tracer.tid, Tracer.names[Tracer.tid - 1],
+			Tracer.start, now);
+	}
+	Tracer.start = now;
+	Tracer.flowed = false;
+}
+
+/* Trace a scheduler span on the run() track, from since to
+ * now. A sweep ends when its last run does, so it can skip reading the
+ * clock again. */
+static void
+trace_sched(const char *name, uint64_t since, bool read_clock)
+{
+	if (!Tracer.on) return;
+
+	if (read_clock) Tracer.start = trace_clock();
+	trace_span(0, name, since, Tracer.start);
+}
+
+/* The live count of processors in state */
+static uint64_t *
+live_count(ProcState state)
+{
+	switch (state) {
+	case PROC_BLOCKED:
+		return &Live.blocked;
+	case PROC_HALTED:
+		return &Live.halted;
+	default:
+		return &Live.runnable;
+	}
+}
+
+/* Move a processor from its live count to state's */
+static void
+count_proc(ProcLoader *loader, ProcState state)
+{
+	if (loader->state == state) return;
+	(*live_count(loader->state))--;
+	(*live_count(state))++;
+	loader->state = (uint8_t) state;
+}
+
+/* Run a processor until it blocks, halts, or has executed limit
+ * instructions, and return how many it executed */
+static uint64_t run_proc(ProcNode *node, ProcLoader *loader, uint64_t limit)
+{
+	uint64_t n = 0, end;
+
+	/* Count the instructions for the live stats in slices, so that a
+	 * processor that never blocks still shows progress. One that
+	 * outlasts a slice counts as runnable until it stops. */
+	do {
+		uint64_t start = n;
+
+		end = limit - n > LIVE_TICKS ? n + LIVE_TICKS : limit;
+		while (n < end && tick(node)) n++;
+		Live.ticks += n - start;
+		if (n == LIVE_TICKS) count_proc(loader, PROC_RUNNABLE);
+	} while (n == end && n < limit);
+	return n;
+}
+
+/*
+ * Called when no processor can make progress. Flush every file node,
+ * then wait until a descriptor that a processor is blocked on becomes
+ * ready. Return false if nothing is waiting on IO, so that the program
+ * is done.
+ */
+static bool
+wait_files(VM *vm)
+{
+	struct pollfd *fds = ecalloc(vm->nfiles + 1, sizeof(*fds));
+	nfds_t nfds = 0;
+	bool ready = false;
+	uint64_t since = Tracer.start;
+
+	for (size_t i = 0; i < vm->nfiles; i++) {
+		FileNode *file = &vm->files[i];
+		short events = 0;
+
+		flush_file(file);
+		if (file->wwait && file->wlen < FILE_BUF) ready = true;
+		if (file->rwait) events |= POLLIN;
+		if (file->wlen > 0) events |= POLLOUT;
+		file->rwait = file->wwait = false;
+
+		if (events) {
+			fds[nfds].fd = file->fd;
+			fds[nfds].events = events;
+			nfds++;
+		}
+	}
+
+	if (IO.rwait) {
+		fds[nfds].fd = STDIN_FILENO;
+		fds[nfds].events = POLLIN;
+		nfds++;
+		IO.rwait = false;
+	}
+
+	/* Flushing alone may have unblocked a writer. */
+	if (!ready && nfds > 0) {
+		while (poll(fds, nfds, -1) < 0) {
+			if (errno != EINTR)
+				err(1, "poll");
+		}
+	}
+
+	free(fds);
+	trace_sched("wait", since, true);
+	return ready || nfds > 0;
 }
 
 void run(VM *vm)
 {
-	bool progressed ;
+	bool progressed, ran;
+	uint64_t since, n;
+
+	if (!vm->linked) link_vm(vm);
+
+	/* Each processor's state is updated as it runs, so the counts are
+	 * current even in the middle of a sweep. */
+	Live.runnable = Live.blocked = Live.halted = 0;
+	for (size_t i = 0; i < vm->nprocs; i++)
+		(*live_count(vm->loaders[i].state))++;
+#ifdef PROFILE
+	vm->prof->start_ns = now_ns();
+#endif
+	Tracer.start = Tracer.on ? trace_clock() : 0;
+
 	do {
-		progressed = false;
-		for (size_t i = 0; i < vm->nnodes; i++) {
-			if (vm->nodes[i].type == PROC_NODE)
-				progressed |= run_proc(vm->nodes[i].dat);
+		do {
+			progressed = false;
+			since = Tracer.start;
+#ifdef PROFILE
+			vm->prof->sweeps++;
+#endif
+			for (size_t i = 0; i < vm->nprocs; i++) {
+				ProcNode *proc = &vm->procs[i];
+				if (!proc->code) {
+					if (!wants_load(proc, &vm->loaders[i])) {
+						count_proc(&vm->loaders[i],
+							PROC_BLOCKED);
+						continue;
+					}
+					load_proc(proc, &vm->loaders[i]);
+					sample_proc(vm, i);
+				}
+#ifdef PROFILE
+				Globals.cur = &vm->prof->procs[i];
+#endif
+				op_select(vm, i);
+				Sampler.cur = i;
+				Tracer.tid = (uint32_t) i + 1;
+				n = run_proc(proc, &vm->loaders[i], vm->budget ?
+					vm->budget - vm->ticks : UINT64_MAX);
+				vm->ticks += n;
+				ran = n > 0;
+				prof_run(vm, i, ran);
+				trace_run(ran);
+				progressed |= ran;
+				count_proc(&vm->loaders[i],
+					*proc->isp == OP_HALT ? PROC_HALTED
+					: ran ? PROC_RUNNABLE : PROC_BLOCKED);
+				if (vm->budget && vm->ticks == vm->budget) {
+					for (size_t j = 0; j < vm->nfiles; j++)
+						flush_file(&vm->files[j]);
+					goto out;
+				}
+			}
+			Sampler.cur = SIZE_MAX;
+			trace_sched("sweep", since, false);
+		} while (progressed);
+#ifdef PROFILE
+		vm->prof->waits++;
+#endif
+	} while (wait_files(vm));
+
+out:
+	Sampler.cur = SIZE_MAX;
+#ifdef PROFILE
+	vm->prof->end_ns = now_ns();
+#endif
+}
+
+#ifdef PROFILE
+/* Return how long a wire side has been stalled, counting a stall that
+ * was still going when the program ended */
+static uint64_t
+stall_ns(const Profile *prof, uint64_t ns, uint64_t since)
+{
+	return since ? ns + (prof->end_ns - since) : ns;
+}
+
+static double
+ms(uint64_t ns)
+{
+	return (double) ns / 1e6;
+}
+
+/*
+ * Print a table of every processor's and wire's counters to stderr.
+ * If json isn't NULL, write them to it as well.
+ */
+void
+write_profile(const VM *vm, FILE *json)
+{
+	const Profile *prof = vm->prof;
+	const char *sep = "";
+
+	if (!prof) return;
+
+	fprintf(stderr, "\nprofile: %llu sweeps, %llu waits, %.3f ms\n\n",
+		(unsigned long long) prof->sweeps,
+		(unsigned long long) prof->waits,
+		ms(prof->end_ns - prof->start_ns));
+	fprintf(stderr, "%-16s %12s %10s %10s %10s %10s %10s %10s %12s\n",
+		"processor", "instrs", "sends", "sendfail", "recvs",
+		"recvfail", "runs", "blocked", "halted(ms)");
+	for (size_t i = 0; i < vm->nnodes; i++) {
+		const Node *node = &vm->nodes[i];
+		const ProcStats *stats;
+
+		if (node->type != PROC_NODE) continue;
+		stats = &prof->procs[node->idx];
+		fprintf(stderr, "%-16s %12llu %10llu %10llu %10llu %10llu %10llu %10llu",
+			node->name ? node->name : "?",
+			(unsigned long long) stats->instrs,
+			(unsigned long long) stats->sends,
+			(unsigned long long) stats->send_fails,
+			(unsigned long long) stats->recvs,
+			(unsigned long long) stats->recv_fails,
+			(unsigned long long) stats->runs,
+			(unsigned long long) stats->blocked);
+		if (stats->halt_ns)
+			fprintf(stderr, " %12.3f\n", ms(prof->end_ns - stats->halt_ns));
+		else
+			fprintf(stderr, " %12s\n", "-");
+	}
+
+	fprintf(stderr, "\n%-32s %10s %10s %12s %10s %12s\n",
+		"wire", "messages", "sendstall", "sendstall(ms)",
+		"recvstall", "recvstall(ms)");
+	for (size_t i = 0; i < vm->nwires; i++) {
+		const WireStats *wire = &prof->wires[i];
+
+		fprintf(stderr, "%-32s %10llu %10llu %12.3f %10llu %12.3f\n",
+			vm->wirenames[i] ? vm->wirenames[i] : "?",
+			(unsigned long long) wire->messages,
+			(unsigned long long) wire->send_stalls,
+			ms(stall_ns(prof, wire->send_ns, wire->send_since)),
+			(unsigned long long) wire->recv_stalls,
+			ms(stall_ns(prof, wire->recv_ns, wire->recv_since)));
+	}
+
+	if (!json) return;
+
+	/* Names are identifiers, and need no escaping. */
+	fprintf(json, "{\n  \"sweeps\": %llu,\n  \"waits\": %llu,\n"
+		"  \"elapsed_ns\": %llu,\n  \"processors\": [",
+		(unsigned long long) prof->sweeps,
+		(unsigned long long) prof->waits,
+		(unsigned long long) (prof->end_ns - prof->start_ns));
+	for (size_t i = 0; i < vm->nnodes; i++) {
+		const Node *node = &vm->nodes[i];
+		const ProcStats *stats;
+
+		if (node->type != PROC_NODE) continue;
+		stats = &prof->procs[node->idx];
+		fprintf(json, "%s\n    {\"name\": \"%s\", \"instructions\": %llu, "
+			"\"sends\": %llu, \"send_fails\": %llu, "
+			"\"recvs\": %llu, \"recv_fails\": %llu, "
+			"\"runs\": %llu, \"blocked\": %llu, ",
+			sep, node->name ? node->name : "?",
+			(unsigned long long) stats->instrs,
+			(unsigned long long) stats->sends,
+			(unsigned long long) stats->send_fails,
+			(unsigned long long) stats->recvs,
+			(unsigned long long) stats->recv_fails,
+			(unsigned long long) stats->runs,
+			(unsigned long long) stats->blocked);
+		if (stats->halt_ns)
+			fprintf(json, "\"halted_ns\": %llu}",
+				(unsigned long long) (prof->end_ns - stats->halt_ns));
+		else
+			fprintf(json, "\"halted_ns\": null}");
+		sep = ",";
+	}
+
+	fprintf(json, "\n  ],\n  \"wires\": [");
+	sep = "";
+	for (size_t i = 0; i < vm->nwires; i++) {
+		const WireStats *wire = &prof->wires[i];
+
+		fprintf(json, "%s\n    {\"name\": \"%s\", \"messages\": %llu, "
+			"\"send_stalls\": %llu, \"send_stall_ns\": %llu, "
+			"\"recv_stalls\": %llu, \"recv_stall_ns\": %llu}",
+			sep, vm->wirenames[i] ? vm->wirenames[i] : "?",
+			(unsigned long long) wire->messages,
+			(unsigned long long) wire->send_stalls,
+			(unsigned long long) stall_ns(prof, wire->send_ns, wire->send_since),
+			(unsigned long long) wire->recv_stalls,
+			(unsigned long long) stall_ns(prof, wire->recv_ns, wire->recv_since));
+		sep = ",";
+	}
+	fprintf(json, "\n  ]\n}\n");
+}
+#endif
+
+#ifdef OPSTATS
+/*
+ * Write the dispatch counters as CSV rows of kind,a,b,count:
+ *
+ *   op,NAME,,count          dispatches of each opcode
+ *   pair,NAME,NAME,count    dispatches of b right after a
+ *   addr,PROCESSOR,ADDR,count  dispatches at each address
+ *
+ * Rows with a count of zero are left out. `nodedc --opstats` reads the
+ * addr rows back to annotate its listing.
+ */
+void
+write_opstats(const VM *vm, FILE *csv)
+{
+	const OpStats *stats = vm->opstats;
+
+	if (!stats) return;
+
+	fprintf(csv, "kind,a,b,count\n");
+	for (int a = 0; a < NUM_OPCODES; a++) {
+		if (stats->ops[a])
+			fprintf(csv, "op,%s,,%llu\n", opstr(a),
+				(unsigned long long) stats->ops[a]);
+	}
+
+	for (int a = 0; a < NUM_OPCODES; a++) {
+		for (int b = 0; b < NUM_OPCODES; b++) {
+			if (!stats->pairs[a][b]) continue;
+			fprintf(csv, "pair,%s,%s,%llu\n", opstr(a), opstr(b),
+				(unsigned long long) stats->pairs[a][b]);
 		}
-	} while (progressed);
+	}
+
+	for (size_t i = 0; i < vm->nnodes; i++) {
+		const Node *node = &vm->nodes[i];
+		const ProcNode *proc = &vm->procs[node->idx];
+		const uint64_t *addrs;
+
+		if (node->type != PROC_NODE) continue;
+		if (!(addrs = stats->addrs[node->idx])) continue;
+
+		for (ptrdiff_t a = 0; a < proc->code_end - proc->code; a++) {
+			if (!addrs[a]) continue;
+			fprintf(csv, "addr,%s,%td,%llu\n",
+				node->name ? node->name : "?", a,
+				(unsigned long long) addrs[a]);
+		}
+	}
 }
+#endif